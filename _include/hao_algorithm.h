@@ -5,6 +5,9 @@
 #include <locale>
 #include <cctype>
 #include <cstring>
+#include <cstdint>
+#include <string>
+#include <string_view>
 
 static inline void LeftTrim(std::string &content)
 {
@@ -33,6 +36,38 @@ inline void MemZero(void* ptr, size_t size)
     memset(ptr, 0, size);
 }
 
+// CRC32，多项式0x04C11DB7，高位在前，初始值0xFFFFFFFF，结果不取反
+// 启动时按CPU支持的指令选择下面的某一个实现，结果完全相同
 uint32_t GetCRC(const unsigned char *data, size_t len);
 
+// GetCRC的各个实现，单独列出来用于校验和基准测试
+// 逐字节查表，最初的实现
+uint32_t GetCRCBytewise(const unsigned char *data, size_t len);
+// 每次处理8个字节(slicing-by-8)
+uint32_t GetCRCSlicing8(const unsigned char *data, size_t len);
+// 用PCLMULQDQ做128位折叠，CPU不支持时退回slicing-by-8
+uint32_t GetCRCPclmul(const unsigned char *data, size_t len);
+bool HasCRCPclmul();
+// GetCRC当前使用的实现的名字
+const char* GetCRCName();
+
+// CRC32C(Castagnoli)，CPU支持SSE4.2时用crc32指令，否则查表
+uint32_t GetCRC32C(const unsigned char *data, size_t len);
+// 64位的xxHash(XXH64)
+uint64_t GetXXHash64(const unsigned char *data, size_t len, uint64_t seed = 0);
+
+// 包头校验算法，每个监听端口可以单独配置
+struct Checksum
+{
+    const char* name;
+    // 计算发出去的包的校验值，包头中只有32位，64位的算法把高低32位异或
+    uint32_t (*compute)(const unsigned char *data, size_t len);
+    // 验证收到的包，不校验的算法直接返回true
+    bool (*verify)(const unsigned char *data, size_t len, uint32_t expected);
+};
+
+// 按名字查找校验算法："crc32"(原来的GetCRC，名字为空时也用它)、"crc32c"、"xxhash64"、"none"
+// 找不到返回nullptr
+const Checksum* FindChecksum(std::string_view name);
+
 #endif
\ No newline at end of file
@@ -95,6 +95,8 @@ namespace hao_util
             void Prepend(const void* data, size_t len);
 
             void Shrink(size_t reserve);
+            // 底层存储的总容量
+            size_t InternalCapacity() const;
 
             ssize_t ReadFd(int fd, int* saved_errno);
 
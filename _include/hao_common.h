@@ -5,16 +5,7 @@
 
 // 包最大长度 = 包头 + 包体
 constexpr int PKG_MAX_LENGTH {30000};
-// 包头的最大长度，最大长度要大于 Pkg_Header
-constexpr int DATA_BUFSIZE {20};
 
-enum class PkgState
-{
-    Head_Init,
-    Haed_Recving,
-    Body_Init,
-    Body_Recving
-};
 class Connection;
 
 struct MsgHeader
@@ -31,9 +22,22 @@ struct PkgHeader
     uint16_t msg_code;
     uint32_t crc32;
 };
+
+// 流式传输的分片：msg_code的最高位为1，包体开头是StreamHeader，后面是这一片的数据
+// 一个数据流按offset从0开始连续发送，每一片都是一个普通大小的包，total_len可以远大于PKG_MAX_LENGTH
+struct StreamHeader
+{
+    // 整个数据流的长度
+    uint32_t total_len;
+    // 这一片数据在数据流中的位置
+    uint32_t offset;
+};
 #pragma pack(pop)
 
+constexpr uint16_t kStreamFlag{0x8000};
+
 constexpr int kMsgHeaderSize{sizeof(MsgHeader)};
 constexpr int kPkgHeaderSize{sizeof(PkgHeader)};
+constexpr int kStreamHeaderSize{sizeof(StreamHeader)};
 
 #endif
\ No newline at end of file
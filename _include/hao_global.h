@@ -30,6 +30,9 @@ extern ProcessType process_type;
 
 extern sig_atomic_t worker_status_changed;
 
+// worker进程收到SIGUSR2后置1，由统计线程打印统计信息
+extern sig_atomic_t print_info_requested;
+
 // 保存环境变量
 extern size_t g_argv_space;
 extern size_t g_env_space;
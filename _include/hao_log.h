@@ -1,48 +1,100 @@
 #ifndef _HAO_LOG_H_
 #define _HAO_LOG_H_
 
+#include "hao_log_format.h"
+
 #include <sys/types.h>
 #include <errno.h>
 #include <string>
 #include <string_view>
+#include <atomic>
+#include <cstdint>
 using std::string_view;
 
+// 编译期保留的最低日志级别(数值最大的级别)，级别数值比它大的日志语句在编译时就被去掉(if constexpr)，
+// 既不会判断运行时的级别，也不会格式化参数，不依赖优化选项。由makefile中的LOG_MIN_LEVEL指定，默认全部保留
+#ifndef HAO_LOG_MIN_LEVEL
+#define HAO_LOG_MIN_LEVEL 9
+#endif
+
 
 namespace hao_log
 {
     const int kLogLineSize { 4096 };
     const int kMaxNumericSize { 48 };
+    // 异步模式下每个线程暂存日志的缓冲区大小
+    const size_t kDefaultAsyncBufferSize { 256 * 1024 };
     enum LogLevel
     {
-        STDERR = 0, EMERG, ALERT, CRIT, ERROR, WARN, NOTICE, INFO, DEBUG
+        STDERR = 0, EMERG, ALERT, CRIT, ERROR, WARN, NOTICE, INFO, DEBUG, TRACE
     };
 
-    void LOG_INIT(string_view filename, LogLevel init_level);
+    // async为true时每个线程先把日志写到自己的缓冲区，由后台线程用writev批量写入文件
+    // 缓冲区满了的日志直接丢弃并计数，由后台线程定期报告丢弃的条数
+    void LOG_INIT(string_view filename, LogLevel init_level, bool async = false, size_t buffer_size = kDefaultAsyncBufferSize);
+    // 日志时间改用CLOCK_REALTIME_COARSE，时间精度降到几毫秒，换取更低的取时间开销
+    void LOG_USE_COARSE_CLOCK(bool coarse);
+    // 日志文件超过max_bytes字节或者跨过interval_seconds秒的时间段(按本地时间对齐)时轮转，0表示不启用
+    // 轮转由异步日志的后台线程完成，同步模式下不轮转，配置了的话会写一条WARN日志提醒
+    void LOG_SET_ROTATION(size_t max_bytes, int interval_seconds);
+    // 请求重新打开日志文件(外部改名日志文件后使用)，只设置标志，可以在信号处理函数中调用
+    void LOG_REQUEST_REOPEN();
+    // 改为写二进制日志，参数直接以原始字节写入，用hao_logdump还原成文本
+    // 当前文件已经有文本日志时先轮转出去，保证一个文件中只有一种格式
+    void LOG_USE_BINARY(bool binary);
     void LOG_EXIT();
     LogLevel GetLevel();
     void LOG_TO_STDERR(int err, const char * fmt, ...);
     
     #define LOG_SET_LEVEL(level) global_log_.log_level_ = level;
 
+    // 日志调用点，每条日志语句一个静态对象，常量初始化，不需要运行时的初始化检查
+    struct LogSite
+    {
+        const char* file;
+        unsigned int line;
+        uint32_t id;
+        // 二进制模式下该调用点的定义最后写到了第几代日志文件，每打开一个新文件加1
+        std::atomic<uint32_t> generation;
+
+        constexpr LogSite(const char* site_file, unsigned int site_line)
+            :file{site_file}, line{site_line}, id{SiteId(site_file, site_line)}, generation{0}
+        {
+
+        }
+    };
+
+    #define _LOG_SITE_ \
+        ([]() -> LogSite& { static LogSite site{__FILE__, __LINE__}; return site; }())
+
+    // 级别只在运行时才知道的日志，LOG(level)使用
     #define _LOG_LEVEL_(level, cur_errno) \
-        (level > GetLevel()) ? (void)0: \
-            Voidify() & Log(level, __FILE__, __LINE__, cur_errno)
+        ((level) > HAO_LOG_MIN_LEVEL || (level) > GetLevel()) ? (void)0: \
+            Voidify() & Log(level, _LOG_SITE_, cur_errno)
+
+    // 级别是编译期常量的日志，超过HAO_LOG_MIN_LEVEL的语句落在if constexpr被丢弃的分支里，
+    // 不管用什么优化级别都不会生成代码，参数也不会求值
+    // 写成 if constexpr(...) {} else ... 的形式，语句外面的if/else不会和它配错
+    #define _LOG_CONST_LEVEL_(level, cur_errno) \
+        if constexpr((level) > HAO_LOG_MIN_LEVEL) {} else _LOG_LEVEL_(level, cur_errno)
     
-    #define LOG_EMERG  _LOG_LEVEL_(LogLevel::EMERG, errno)
-    #define LOG_ALERT  _LOG_LEVEL_(LogLevel::ALERT, errno)
-    #define LOG_CRIT   _LOG_LEVEL_(LogLevel::CRIT, errno)
-    #define LOG_ERROR  _LOG_LEVEL_(LogLevel::ERROR, errno)
-    #define LOG_WARN   _LOG_LEVEL_(LogLevel::WARN, errno)
-    #define LOG_NOTICE _LOG_LEVEL_(LogLevel::NOTICE, errno)
-    #define LOG_INFO   _LOG_LEVEL_(LogLevel::INFO, errno)
-    #define LOG_DEBUG  _LOG_LEVEL_(LogLevel::DEBUG, errno)
+    #define LOG_EMERG  _LOG_CONST_LEVEL_(LogLevel::EMERG, errno)
+    #define LOG_ALERT  _LOG_CONST_LEVEL_(LogLevel::ALERT, errno)
+    #define LOG_CRIT   _LOG_CONST_LEVEL_(LogLevel::CRIT, errno)
+    #define LOG_ERROR  _LOG_CONST_LEVEL_(LogLevel::ERROR, errno)
+    #define LOG_WARN   _LOG_CONST_LEVEL_(LogLevel::WARN, errno)
+    #define LOG_NOTICE _LOG_CONST_LEVEL_(LogLevel::NOTICE, errno)
+    #define LOG_INFO   _LOG_CONST_LEVEL_(LogLevel::INFO, errno)
+    #define LOG_DEBUG  _LOG_CONST_LEVEL_(LogLevel::DEBUG, errno)
+    // 每个包、每个事件都会走到的热点路径上的日志
+    #define LOG_TRACE  _LOG_CONST_LEVEL_(LogLevel::TRACE, errno)
 
     #define LOG(level) _LOG_LEVEL_(level, errno)
 
     class Log
     {
         public:
-            Log(LogLevel level, string_view filename, unsigned int line, int err);
+            Log(LogLevel level, LogSite& site, int err);
             ~Log();
             
             Log(const Log&) = delete;
@@ -72,11 +124,16 @@ namespace hao_log
             void FormatInteger(T);
 
             void Append(const char* src, size_t len);
+            // 二进制模式下追加一个参数：类型标记加原始字节
+            void AppendBinary(uint8_t tag, const void* src, size_t len);
+            void AppendBinaryString(const char* src, size_t len);
             
             char log_line_buffer_[kLogLineSize];
             size_t free_space_;
             char* cur_;
             char* end_;
+            LogLevel level_;
+            bool binary_;
     };
 
     namespace
@@ -0,0 +1,97 @@
+#ifndef _HAO_LOG_FORMAT_H_
+#define _HAO_LOG_FORMAT_H_
+
+#include <cstdint>
+#include <cstddef>
+
+// 日志的输出格式，hao_log和日志解码工具hao_logdump共用
+namespace hao_log
+{
+    // 文本日志中的级别字符串，每个都是8个字符
+    constexpr const char* h_level_string(int level)
+    {
+        return &"[      ]"      // null string
+                "[emerg ]"      // system is unusable
+                "[alert ]"      // action must be taken immediately
+                "[crit  ]"      // critical conditions
+                "[error ]"      // error conditions
+                "[warn  ]"      // warning conditions
+                "[notice]"      // normal, but significant, condition
+                "[info  ]"      // informational message
+                "[debug ]"      // debug-level message
+                "[trace ]"      // hot-path trace message
+                [level * 8];
+    }
+
+    // 调用点的id，由文件名和行号算出来(FNV-1a)，同一份代码在各个进程、每次启动中都一样
+    constexpr uint32_t SiteId(const char* file, unsigned int line)
+    {
+        uint32_t hash{2166136261u};
+        for(const char* p = file; *p != '\0'; ++p)
+        {
+            hash = (hash ^ static_cast<unsigned char>(*p)) * 16777619u;
+        }
+        for(int i{0}; i < 4; ++i)
+        {
+            hash = (hash ^ ((line >> (i * 8)) & 0xFF)) * 16777619u;
+        }
+        return hash;
+    }
+
+    // 二进制日志：文件开头是魔数，后面是一条条记录，数值都是本机字节序
+    // 每个调用点(文件名、行号)只在每个文件中写一次定义，之后的记录只带调用点id和参数的原始字节
+    // 异步模式下轮转前已经进了缓冲区的记录可能落到新文件中，它的定义却在旧文件里，解码时要把上一个文件一起给出
+    namespace binary
+    {
+        constexpr char kMagic[8]{'H', 'A', 'O', 'L', 'O', 'G', 'B', '1'};
+
+        enum RecordKind : uint8_t
+        {
+            kSiteRecord = 1,
+            kLogRecord = 2
+        };
+
+        // 参数的类型标记，后面跟对应大小的原始字节，字符串是2字节长度加内容
+        enum ArgTag : uint8_t
+        {
+            kBool = 'b',
+            kChar = 'c',
+            kInt32 = 'i',
+            kUint32 = 'u',
+            kInt64 = 'l',
+            kUint64 = 'L',
+            kDouble = 'd',
+            kPointer = 'p',
+            kString = 's'
+        };
+
+#pragma pack(push, 1)
+        // 每条记录的头部，length包括头部本身
+        struct RecordHeader
+        {
+            uint16_t    length;
+            uint8_t     kind;
+        };
+
+        // 调用点定义，后面跟file_len字节的文件名
+        struct SiteRecord
+        {
+            uint32_t    site_id;
+            uint32_t    line;
+            uint16_t    file_len;
+        };
+
+        // 一条日志，后面跟各个参数
+        struct LogRecord
+        {
+            uint32_t    site_id;
+            int32_t     pid;
+            int64_t     time_us;
+            int32_t     err;
+            uint8_t     level;
+        };
+#pragma pack(pop)
+    }
+}
+
+#endif
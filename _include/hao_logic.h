@@ -2,6 +2,36 @@
 #define _HAO_LOGIC_H_
 
 #include "hao_socket.h"
+#include "hao_logic_common.h"
+
+// 业务处理函数的结果
+enum class HandleResult
+{
+    // 包不合法，收到的消息块由HandleMessage释放
+    Failed,
+    // 处理完了，收到的消息块由HandleMessage释放
+    Done,
+    // 处理函数拿走了收到的消息块(比如原地改成回包发出去了)，HandleMessage不能再碰它
+    BufferTaken
+};
+
+// 数据流的一片，data指向收到的消息块内部，处理函数返回后就失效
+struct StreamChunk
+{
+    const char* data;
+    uint32_t    length;
+    uint32_t    offset;
+    uint32_t    total_len;
+
+    bool First() const
+    {
+        return offset == 0;
+    }
+    bool Last() const
+    {
+        return offset + length == total_len;
+    }
+};
 
 class LogicSocket
 {
@@ -10,13 +40,22 @@ class LogicSocket
         ~LogicSocket();
     public:
         void SendBodyPkgToClient(MsgHeader* p_msg_header, unsigned short msg_code);
-        bool HandleRegister(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length);
-        bool HandleLogin(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length);
-        bool HandlePing(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length);
+        // 包体已经由路由检查过长度并转换成本机字节序
+        HandleResult HandleRegister(Connection* p_conn, MsgHeader* p_msg_header, Register* p_recv_info);
+        HandleResult HandleLogin(Connection* p_conn, MsgHeader* p_msg_header, Login* p_recv_info);
+        HandleResult HandlePing(Connection* p_conn, MsgHeader* p_msg_header);
+        HandleResult HandleUpload(Connection* p_conn, MsgHeader* p_msg_header, const StreamChunk& chunk);
     
         void HandlePingOut(MsgHeader* p_mgs_header, Timestamp cur_time);
         void HandleMessage(char *p_msg_buf);
         void AfterMessage(char *p_msg_buf);
+    private:
+        // 业务处理时锁住连接，连接固定在一个逻辑线程上时不需要加锁
+        std::unique_lock<std::mutex> LockConnection(Connection* p_conn);
+        // 收到的消息块原地改成msg_code的回包发出去，包体长度不能超过收到的包体
+        // 检查数据流分片的顺序和长度，合法的话交给cmd的处理函数
+        HandleResult HandleStreamFrame(Connection* p_conn, MsgHeader* p_msg_header, uint16_t cmd, char* p_pkg_body, uint16_t body_length);
+        HandleResult ReplyInPlace(Connection* p_conn, MsgHeader* p_msg_header, uint16_t msg_code, uint16_t body_length, bool body_modified);
 };
 
 #endif
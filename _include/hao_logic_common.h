@@ -1,10 +1,18 @@
 #ifndef _HAO_LOGIC_COMMON_H_
 #define _HAO_LOGIC_COMMON_H_
 
+#include <arpa/inet.h>
+
+#include <cstdint>
+
 const       int CMD_START{0};
 constexpr   int CMD_PING{CMD_START};
+// 服务器过载时由网络层直接回的包，只有包头，对应的请求没有被处理
+constexpr   int CMD_BUSY{CMD_START + 1};
 constexpr   int CMD_REGISTER{CMD_START + 5};
 constexpr   int CMD_LOGIN{CMD_START + 6};
+// 流式上传，分片带kStreamFlag发送，最后一片收完后回一个UploadResult
+constexpr   int CMD_UPLOAD{CMD_START + 7};
 
 // 结构定义
 #pragma pack(push, 1)
@@ -22,6 +30,27 @@ struct Login
     char    password[40];
 };
 
+struct UploadResult
+{
+    uint32_t    total_len;
+};
+
 #pragma pack(pop)
 
+// 有多字节字段的包体要提供字节序转换，收到时由路由转换成本机字节序，回包前由处理函数转换回去
+inline void NetworkToHost(Register& body)
+{
+    body.type = ntohl(body.type);
+}
+
+inline void HostToNetwork(Register& body)
+{
+    body.type = htonl(body.type);
+}
+
+inline void HostToNetwork(UploadResult& body)
+{
+    body.total_len = htonl(body.total_len);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,134 @@
+#ifndef _HAO_LOGIC_ROUTER_H_
+#define _HAO_LOGIC_ROUTER_H_
+
+#include "hao_logic.h"
+
+#include <array>
+#include <cstdint>
+#include <type_traits>
+
+// 包体的字节序转换，有多字节字段的包体结构在hao_logic_common.h中提供自己的重载
+template <typename Body>
+inline void NetworkToHost(Body&) {}
+
+// 一条路由：命令码Cmd的包体是Body(void表示没有包体)，由LogicSocket的成员函数Handler处理
+// 有包体时Handler的形式为 HandleResult (LogicSocket::*)(Connection*, MsgHeader*, Body*)
+// 没有包体时Handler的形式为 HandleResult (LogicSocket::*)(Connection*, MsgHeader*)
+// Body为StreamChunk时是流式传输的命令，Handler的形式为 HandleResult (LogicSocket::*)(Connection*, MsgHeader*, const StreamChunk&)
+// 流式命令只接受带kStreamFlag的分片，普通命令只接受普通的包
+template <int Cmd, typename Body, auto Handler>
+struct Route
+{
+    static_assert(Cmd >= 0 && Cmd <= UINT16_MAX, "命令码必须能放进包头的msg_code");
+    static_assert(std::is_void_v<Body> || std::is_trivially_copyable_v<Body>, "包体必须是可以直接按字节解释的结构");
+
+    static constexpr int kCmd{Cmd};
+
+    // 包体长度在这里统一检查，包体按网络字节序转换好后再交给Handler
+    static HandleResult Dispatch(LogicSocket& logic, Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length, const StreamChunk* chunk)
+    {
+        if constexpr(std::is_same_v<Body, StreamChunk>)
+        {
+            if(chunk == nullptr)
+            {
+                return HandleResult::Failed;
+            }
+            return (logic.*Handler)(p_conn, p_msg_header, *chunk);
+        }
+        else
+        {
+            if(chunk != nullptr)
+            {
+                return HandleResult::Failed;
+            }
+            if constexpr(std::is_void_v<Body>)
+            {
+                if(body_length != 0)
+                {
+                    return HandleResult::Failed;
+                }
+                return (logic.*Handler)(p_conn, p_msg_header);
+            }
+            else
+            {
+                if(p_pkg_body == nullptr || body_length != sizeof(Body))
+                {
+                    return HandleResult::Failed;
+                }
+                Body* p_body = reinterpret_cast<Body*>(p_pkg_body);
+                NetworkToHost(*p_body);
+                return (logic.*Handler)(p_conn, p_msg_header, p_body);
+            }
+        }
+    }
+};
+
+namespace router_detail
+{
+    using Thunk = HandleResult (*)(LogicSocket& logic, Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length, const StreamChunk* chunk);
+
+    inline HandleResult Unknown(LogicSocket&, Connection*, MsgHeader*, char*, uint16_t, const StreamChunk*)
+    {
+        return HandleResult::Failed;
+    }
+
+    template <typename... Routes>
+    constexpr int MaxCommand()
+    {
+        int max_cmd{0};
+        ((max_cmd = Routes::kCmd > max_cmd ? Routes::kCmd : max_cmd), ...);
+        return max_cmd;
+    }
+
+    template <typename... Routes>
+    constexpr bool Unique()
+    {
+        std::array<bool, MaxCommand<Routes...>() + 1> used{};
+        bool unique{true};
+        ((unique = unique && !used[Routes::kCmd], used[Routes::kCmd] = true), ...);
+        return unique;
+    }
+
+    template <typename... Routes>
+    constexpr std::array<Thunk, MaxCommand<Routes...>() + 1> BuildTable()
+    {
+        std::array<Thunk, MaxCommand<Routes...>() + 1> table{};
+        for(auto& thunk : table)
+        {
+            thunk = &Unknown;
+        }
+        ((table[Routes::kCmd] = &Routes::Dispatch), ...);
+        return table;
+    }
+}
+
+// 由一组Route在编译期生成的稠密分发表，命令码就是下标，没有注册的命令码落到Unknown上
+template <typename... Routes>
+class Router
+{
+    static_assert(sizeof...(Routes) > 0, "至少要有一条路由");
+    static_assert(router_detail::Unique<Routes...>(), "同一个命令码注册了多次");
+
+    public:
+        static constexpr int kTotalCommands{router_detail::MaxCommand<Routes...>() + 1};
+
+        // msg_code超出表的范围或者没有注册时返回Failed，chunk不为空表示这是数据流的一片
+        static HandleResult Dispatch(LogicSocket& logic, uint16_t msg_code, Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length, const StreamChunk* chunk = nullptr)
+        {
+            if(msg_code >= kTotalCommands)
+            {
+                return HandleResult::Failed;
+            }
+            return kTable[msg_code](logic, p_conn, p_msg_header, p_pkg_body, body_length, chunk);
+        }
+
+        static bool Registered(uint16_t msg_code)
+        {
+            return msg_code < kTotalCommands && kTable[msg_code] != &router_detail::Unknown;
+        }
+
+    private:
+        static constexpr std::array<router_detail::Thunk, kTotalCommands> kTable{router_detail::BuildTable<Routes...>()};
+};
+
+#endif
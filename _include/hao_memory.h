@@ -2,7 +2,17 @@
 #define _HAO_MEMORY_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <atomic>
 
+// 按大小分级的内存分配器
+// 每个线程有自己的缓存，同一大小级别的内存块从一大块slab中切出来，释放后挂回所属线程的空闲链表
+// 其他线程释放的内存块先放到所属线程的远程释放链表中，由所属线程下次分配时取回
+// slab直接从系统mmap，某个级别完全空闲的slab攒多了会munmap一部分，内存占用不会一直停在峰值
+// 超过最大级别的大块内存直接走malloc/free
+// 编译时定义HAO_MEMORY_STATS(config.mk中MEMORY_STATS = true)才会统计分配信息，否则没有任何额外开销
 class Memory
 {
     public:
@@ -15,9 +25,46 @@ class Memory
         Memory& operator=(const Memory&) = delete;
         Memory& operator=(Memory&&) = delete;
 
+        struct ThreadCache;
+
+#ifdef HAO_MEMORY_STATS
+        // 把分配统计写到日志中：在用字节数、峰值、每秒分配次数、各大小级别的分配次数
+        void PrintStats();
+#endif
+
     private:
         Memory() = default;
+        // 单例故意不析构，见GetInstance
         ~Memory() = default;
+
+        // 取当前线程的缓存，第一次调用时创建或接管一个已退出线程留下的缓存
+        ThreadCache* LocalCache();
+        // 线程退出时把它的缓存交出来，留给以后新建的线程接管
+        void OrphanCache(ThreadCache* cache);
+
+        friend struct CacheHolder;
+
+#ifdef HAO_MEMORY_STATS
+        // 增加在用字节数，同时更新峰值
+        void AddLiveBytes(std::size_t size);
+#endif
+
+        // 已退出线程留下的缓存，其中的内存块还可能被其他线程持有，所以不能直接释放
+        std::mutex                  orphan_mutex_;
+        std::vector<ThreadCache*>   orphan_caches_;
+
+#ifdef HAO_MEMORY_STATS
+        // 所有创建过的线程缓存，统计时要汇总每个线程的计数
+        std::vector<ThreadCache*>   all_caches_;
+        // 使用者申请的在用字节数(不含块头)
+        std::atomic<int64_t>        live_bytes_{0};
+        std::atomic<int64_t>        peak_bytes_{0};
+        // 从系统申请的slab总字节数
+        std::atomic<int64_t>        slab_bytes_{0};
+        // 上次打印时的累计分配次数和时间，用来算每秒分配次数
+        uint64_t                    last_alloc_count_{0};
+        int64_t                     last_print_time_{0};
+#endif
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -5,11 +5,15 @@
 #include "hao_timestamp.h"
 #include "hao_internet_address.h"
 #include "hao_timer.h"
+#include "hao_buffer.h"
+#include "hao_threadpool.h"
+#include "hao_algorithm.h"
 
 #include <semaphore.h>
 
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <vector>
 #include <queue>
@@ -24,6 +28,7 @@
 #include <thread>
 #include <chrono>
 #include <tuple>
+#include <functional>
 
 using std::unordered_map;
 using std::atomic;
@@ -39,14 +44,25 @@ using std::condition_variable;
 using std::thread;
 using std::deque;
 using std::tuple;
+using std::function;
 using std::chrono::seconds;
 
 // epoll 中一次最多接受事件的个数
 constexpr int MAX_EVENTS{512};
+// 一次writev最多聚合的数据包个数
+constexpr int MAX_SEND_IOV{64};
+// 收包缓冲区空闲时超过这个容量就缩回去
+constexpr size_t kRecvBufferShrinkSize{64 * 1024};
+// 有连接因为过载暂停读时，反应堆至少每隔这么久检查一次能否恢复
+constexpr int kOverloadRecheckMilliseconds{50};
+// 暂停读的原因，Connection::read_paused中每个原因占一位，所有原因都解除了才恢复读
+constexpr uint8_t kPauseInFlight{1};        // 在处理中的包达到上限，由RequestDone解除
+constexpr uint8_t kPauseOverload{2};        // 服务器过载，由反应堆在退出过载状态后解除
 
 class Socket;
 class Connection;
 class Listening;
+struct EventLoop;
 
 struct Listening
 {
@@ -54,8 +70,10 @@ struct Listening
     InternetAddress listen_address;
     // 监听套接字也是需要连接池中的连接的，对该连接绑定EPOLL_CTL_ADD
     Connection *connection_ptr;
-    Listening(int fd, const InternetAddress& address)
-        :sockfd{fd}, listen_address{address}, connection_ptr{nullptr}
+    // 这个端口上收发的包使用的校验算法
+    const Checksum *checksum;
+    Listening(int fd, const InternetAddress& address, const Checksum* checksum_ptr)
+        :sockfd{fd}, listen_address{address}, connection_ptr{nullptr}, checksum{checksum_ptr}
     {
 
     }
@@ -65,8 +83,61 @@ struct Listening
     } 
 };
 
+// 一个EventLoop是一个独立的epoll反应堆，有自己的epoll句柄、监听套接字和定时器，
+// 由它accept的连接只在它的线程里收包，心跳超时也只在它的线程里处理
+struct EventLoop
+{
+    // 第几个反应堆，从0开始
+    int                 index;
+    // epoll_create返回的句柄
+    int                 epoll_handle;
+    // epoll_wait返回的活跃事件
+    struct epoll_event  events[MAX_EVENTS];
+    // 该反应堆自己的监听套接字，同一端口靠SO_REUSEPORT由内核分配新连接
+    vector<Listening>   listen_socket_list;
+    // 定时器互斥量，逻辑线程处理心跳包时也会更新定时器
+    mutex               timer_mutex;
+    Timer               timer;
+    // 本轮epoll事件中收到的完整包，事件处理完后一次性交给线程池
+    TaskBatch           pending_tasks;
+    // 因为过载暂停读的连接和暂停时的序号，退出过载状态后由反应堆恢复
+    // 逻辑线程解除其他暂停原因时如果还在过载，也会把连接放进来，所以要加锁
+    mutex               overload_paused_mutex;
+    vector<std::pair<Connection*, uint64_t>> overload_paused;
+    // 运行该反应堆的线程，第0个反应堆直接在worker进程的主线程中运行
+    thread              loop_thread;
+    EventLoop(int loop_index)
+        :index{loop_index}, epoll_handle{-1}
+    {
+
+    }
+};
+
 using event_handler_ptr = void(Socket::*)(Connection*);
 
+// 过载时对新收到的包的处理方式
+enum class OverloadPolicy
+{
+    // 回一个只有包头的CMD_BUSY，丢掉请求
+    Busy,
+    // 直接丢掉请求
+    Drop,
+    // 请求照常处理，但是暂停从这个连接读，退出过载状态后恢复
+    Pause
+};
+
+// 连接上正在接收的数据流，分片都固定在连接对应的逻辑线程上处理，只有那个线程会访问
+struct StreamState
+{
+    // 开始这个数据流时连接的序号，连接被回收复用后数据流自动作废
+    uint64_t    sequence_num{0};
+    uint32_t    total_len{0};
+    // 已经交给处理函数的字节数，下一片的offset必须等于它
+    uint32_t    received{0};
+    uint16_t    msg_code{0};
+    bool        active{false};
+};
+
 // 一个Connection表示一个Tcp连接
 struct Connection
 {
@@ -83,10 +154,14 @@ struct Connection
         const int32_t Id() const;
         // 套接字fd
         int fd;    
-        // 定时器id
-        int32_t timer_id_;                         
+        // 心跳定时器节点，挂在所属反应堆的时间轮上
+        TimerNode timer_node;
+        // 心跳定时器句柄，连接关闭或者被复用后旧句柄自动失效
+        TimerHandle timer_id_;
         // 如果连接被分配给一个监听套接字，则用该指针指向该监听套接字
         Listening *listening_ptr;
+        // 连接所属的反应堆
+        EventLoop *loop;
         
         // nginx的失效标志位，以后可以考虑再次使用
         //unsigned instance:1;
@@ -101,30 +176,32 @@ struct Connection
         uint32_t events;
 
         // 收包相关的变量
-        // 当前收包状态
-        PkgState cur_stat;
-        // 保存收到的包头信息
-        char head_info[DATA_BUFSIZE];
-
-        // 接收数据的缓冲区的头指针，
-        char        *precv_buf;
-        // 要收多少数据
-        uint32_t    recv_len;
-        // new出来的用于收包的内存首地址，释放用的
-        char        * precv_mem_pointer;
+        // 收包缓冲区，一次recv尽量多读，再从里面切出完整的包
+        hao_util::Buffer    recv_buffer;
 
         // 业务逻辑处理的互斥量
         mutex     logic_proc_mutex;
 
+        // 正在接收的数据流
+        StreamState         stream;
+
         // 发包有关
+        // 该连接自己的发送队列，MsgSend放入，发送线程按顺序取出发送
+        list<char*>         send_queue;
+        // 互斥send_queue和send_scheduled
+        mutex               send_queue_mutex;
+        // 该连接是否已交给发送流程：在就绪队列中、正在被发送线程发送或者在等EPOLLOUT
+        bool                send_scheduled;
         // 发送消息，如果发送缓冲区满了，则通过epoll来驱动消息继续发送，
         atomic<int>         throw_send_count;
-        // 发送完成后释放用的，整个数据的头指针，= 消息头+包头+包体
-        char                *send_mem_pointer;
-        // 发送数据的缓冲区的头指针 = 包头+包体
-        char                *send_buf;
-        // 要发送多少数据
-        uint32_t            send_len;
+        // 正在发送的一批数据包，整个数据的头指针 = 消息头+包头+包体，发送完成后释放用的
+        char                *send_batch[MAX_SEND_IOV];
+        // 每个数据包要发送的 包头+包体，部分发送后会调整iov_base和iov_len
+        struct iovec        send_iov[MAX_SEND_IOV];
+        // 这一批数据包的个数
+        int                 send_iov_count;
+        // 第一个还没有发完的数据包的下标
+        int                 send_iov_index;
 
         // 回收有关
         // 到资源回收站里去的时间
@@ -142,6 +219,14 @@ struct Connection
 
         // 发送队列中有的数据条目数，若client只发不收，则可能造成此数过大，依据此数做踢出处理
         atomic<int>         send_count;
+
+        // 流量控制有关
+        // 保护events和epoll_ctl，反应堆、发送线程、逻辑线程都会修改连接关注的事件，关闭fd时也要持有
+        mutex               epoll_mutex;
+        // 已经交给逻辑线程、还没有处理完的包数
+        atomic<int>         in_flight;
+        // 去掉EPOLLIN的原因，kPauseInFlight和kPauseOverload的组合，0表示正常读
+        atomic<uint8_t>     read_paused;
 };
 
 class Socket
@@ -170,6 +255,8 @@ class Socket
 
         // 打印统计信息
         void PrintInfo();
+        // 定时打印统计信息，收到SIGUSR2时也立即打印一次
+        void PrintInfoThread();
 
         // 心跳包检测事件到，该去检测心跳包是否超时的事宜
         // 只是把内存释放，自雷应该重新实现该函数以实现具体的判断动作
@@ -177,20 +264,35 @@ class Socket
 
         // 初始化epoll
         int Epoll_init();
+        // 启动所有反应堆，第0个反应堆在当前线程中运行，不会返回
         void Epoll_Process_Events();
         // 数据扔到发送队列中
         void MsgSend(char *send_buf);
         // 更新连接时间
         void UpdateTimer(Connection* conn, Timestamp when);
+        // 同一个连接的包是否固定由一个逻辑线程按顺序处理，是的话业务处理不用再加连接锁
+        bool ConnectionAffinity() const;
+        // 一个数据流允许的最大字节数，0表示不接受流式传输
+        uint32_t MaxStreamSize() const;
+        // 逻辑线程处理完一个包(不管成功与否)后调用，连接上在处理中的包降下来后恢复读
+        void RequestDone(Connection* conn, uint64_t sequence_num);
     private:
         int Epoll_Oper_Event(int fd, uint32_t event_type, uint32_t flag, int bcaction, Connection * conn);
+        // 调用者已经持有conn->epoll_mutex
+        int EpollCtlLocked(int fd, uint32_t event_type, uint32_t flag, int bcaction, Connection * conn);
+        // 因为reason去掉EPOLLIN，让对端的数据积压在内核缓冲区里，返回这个原因是否是新加上的
+        bool PauseRead(Connection* conn, uint8_t reason);
+        // 解除reason这个暂停原因，没有别的原因时重新关注EPOLLIN
+        void ResumeRead(Connection* conn, uint64_t sequence_num, uint8_t reason);
+        // 调用者已经持有conn->epoll_mutex
+        void ClearPauseLocked(Connection* conn, uint8_t reason);
         
         // 主动关闭一个连接
         void zd_close_socket_proc(Connection* conn);
     private:
         void ReadConfig();
-        // 支持多端口监听
-        bool OpenListeningSockets();
+        // 支持多端口监听，每个反应堆各自打开一份
+        bool OpenListeningSockets(EventLoop *loop);
         // 关闭所有监听套接字
         void CloseListeningSockets();
         // 设置非阻塞套接字
@@ -199,6 +301,10 @@ class Socket
         // 业务处理函数
         // 建立新连接
         void EventAccept(Connection *old);
+        // accept一个新连接，返回false表示没有可以accept的连接了
+        bool AcceptOne(Connection *old);
+        // fd用尽时用预留的idle_fd_接下一个连接并关掉，返回是否接到了
+        bool AcceptWithIdleFd(Connection *old);
         // 设置数据来时的读处理函数
         void ReadRequestHandler(Connection* conn);
         // 设置数据来时的写处理函数
@@ -206,20 +312,44 @@ class Socket
         // 关闭连接函数
         void CloseConnection(Connection*);
 
-        // 接收从客户端来的数据专用函数
-        ssize_t RecvProc(Connection* conn, char *buf, ssize_t buf_len);
+        // 接收从客户端来的数据专用函数，数据追加到连接的收包缓冲区中
+        ssize_t RecvProc(Connection* conn);
         
-        // 包头收完整后的处理，称为包处理阶段1
+        // 从收包缓冲区中切出所有完整的包，称为包处理阶段1
         void WaitRequestHandlerProcP1(Connection* conn, bool& is_flood);
 
-        // 收到一个完整包后的处理
-        void WaitRequestHandlerProcPlast(Connection *conn, bool& is_flood);
+        // 是否是数据流中不是第一片的分片
+        bool IsStreamContinuation(const char* pkg, uint16_t pkg_len) const;
+        // 收到一个完整包后的处理，pkg指向包头，pkg_len为包头+包体的长度
+        void WaitRequestHandlerProcPlast(Connection *conn, const char *pkg, uint16_t pkg_len);
 
         // 清空发送队列
         void ClearMsgSendQueue();
 
-        // 将数据发送到客户端
-        ssize_t SendProc(Connection *conn, char *buf, ssize_t size);
+        // 把有待发数据的连接放入就绪队列，唤醒发送线程
+        void ScheduleSend(Connection *conn);
+
+        // 发送一个连接队列里的数据，直到队列为空或者内核缓冲区满
+        void SendConnectionQueue(Connection *conn);
+
+        // 把连接队列里的数据聚合成一批，用writev发出去
+        // 返回true表示队列和这一批数据都发完了，false表示内核缓冲区满了，剩下的要靠EPOLLOUT驱动
+        bool DrainSendQueue(Connection *conn);
+
+        // 从发送队列中取出一批数据包填到send_iov中，返回这一批数据包的个数
+        int FillSendBatch(Connection *conn);
+
+        // 释放这一批中还没发完的数据包
+        void DropSendBatch(Connection *conn);
+
+        // 交还发送权，返回false表示队列里又来了新数据，发送权仍然保留
+        bool ReleaseSend(Connection *conn);
+
+        // 释放一个连接发送队列中还没发出去的数据
+        void ClearConnectionSendQueue(Connection *conn);
+
+        // 将数据发送到客户端，iov_count个缓冲区一次发出
+        ssize_t SendProc(Connection *conn, struct iovec *iov, int iov_count);
 
         // 获取对端信息，获取端口字符串，返回字符串的长度
         size_t SockNtop(struct sockaddr *sa, int port, u_char *text, size_t len);
@@ -240,21 +370,12 @@ class Socket
         // 将回收的连接放到一个队列中来
         void InRecyConnectQueue(Connection*);
 
-        // 和时间相关的函数
+        // 和时间相关的函数，定时器都属于连接所在的反应堆
         void AddToTimerQueue(Connection *conn);
-        // 从multimap中取得最早的时间返回去
-        Timestamp GetEarliestTime();
-        // 从time_queue_map移除最早的时间，并把最早这个时间所在的项的值所对应的指针返回
-        // 调用者负责互斥，所以本函数不用互斥
-        MsgHeader* RemoveFirstTimer();
-
-        // 根据所给的当前时间，从time_queue_map中找到比这个事件更早的一个节点返回去，
-        // 这些节点都是时间超过了，要处理的节点
-        MsgHeader* GetOverTimeTimer(Timestamp cur_time);
         // 把指定用户tcp连接从timer表中移出
-        void DeleteFromTimerQueue(int32_t timer_id);
+        void DeleteFromTimerQueue(Connection *conn);
         // 清理事件队列中的所有内容
-        void ClearAllFromTimerQueue();
+        void ClearAllFromTimerQueue(EventLoop *loop);
         
 
         // 和网络安全相关
@@ -272,7 +393,24 @@ class Socket
         //void TimerQueueMonitorThread();
 
         // 返回值是下一次epoll_wait timeout的值
-        int TimerHeartBeatCheck();
+        int TimerHeartBeatCheck(EventLoop *loop);
+
+        // 一个反应堆的事件循环
+        void RunEventLoop(EventLoop *loop);
+
+        // 过载保护，在hao_socket_overload.cpp中
+        // 根据线程池和发送队列的积压情况更新过载状态
+        void UpdateOverload();
+        // accept成功后调用，返回false表示要拒绝这个连接
+        bool AdmitConnection();
+        // 切出一个完整的包后调用，返回false表示这个包被丢掉了
+        bool AdmitRequest(Connection* conn, const char* pkg);
+        // 回一个只有包头的CMD_BUSY
+        void SendBusy(Connection* conn);
+        // 记下因为过载暂停读的连接，由它所属的反应堆以后恢复
+        void DeferOverloadResume(Connection* conn);
+        // 退出过载状态后恢复因为过载暂停读的连接
+        void ResumeOverloadPaused(EventLoop* loop);
 
     protected:
         // 网络通讯有关的成员变量
@@ -292,8 +430,10 @@ class Socket
         int worker_connections_;
         // 监听的端口数量
         int listen_port_count_;
-        // epoll_create返回的句柄
-        int epoll_handle_;
+        // 每个worker进程中反应堆的个数
+        int event_loop_threads_;
+        // 所有反应堆
+        vector<unique_ptr<EventLoop>>   event_loops_;
 
         // Epoll进程是否运行
         atomic<bool> running_;
@@ -309,20 +449,19 @@ class Socket
         // 连接相关互斥量，互斥free_connection_list_,connection_list_
         mutex     connection_pool_mutex_;
 
-        //监听套接字队列
-        vector<Listening>   listen_socket_list_;
-        // epoll_wait返回的活跃事件
-        struct epoll_event  events_[MAX_EVENTS];
 
         
         // --------------------数据发送线程------------------------
         // 数据发送线程相关
         thread              send_message_queue_thread_;
-        // 发送数据消息队列
-        list<char*>         send_message_queue_;
-        // 发送消息队列互斥量
-        mutex               send_message_queue_mutex_;
-        condition_variable  send_message_queue_cond_;
+        // 有数据待发且可以发送的连接，发送线程只处理这里的连接
+        // 同时记下放入时的序号，连接关闭或者复用后留在队列里的旧项直接跳过
+        list<std::pair<Connection*, uint64_t>>  send_ready_list_;
+        // 就绪队列互斥量
+        mutex               send_ready_mutex_;
+        condition_variable  send_ready_cond_;
+        // 所有连接发送队列中数据包的总数
+        atomic<int>         send_backlog_count_;
         // -------------------------------------------
 
         // -----------------连接回收线程------------------------
@@ -340,12 +479,10 @@ class Socket
 
         // -----------------------定时器线程----------------------------
         thread              timer_queue_monitor_thread_;  
-        // 定时器队列互斥量
-        mutex               timer_queue_mutex_;
         condition_variable  timer_queue_cond_;
         // 时间队列
         //multimap<Timestamp, MsgHeader*> timer_queue_map_;
-        Timer               timer_;
+        // 定时器和它的互斥量都放到了各自的EventLoop中
         // ------------------------------------------------------------
         
         // 发送消息线程相关的信号量
@@ -372,8 +509,52 @@ class Socket
         // 统计用途
         // 上册打印统计信息的时间
         Timestamp           last_print_time_;
+        // 每隔多少秒打印一次统计信息，0表示只在收到SIGUSR2时打印
+        seconds             print_info_interval_;
+        // 打印统计信息的线程
+        thread              print_info_thread_;
         // 丢弃的发送数据包数量
-        int                 discard_send_pkg_count_;
+        atomic<int>         discard_send_pkg_count_;
+
+        // 连接上没有积压数据时，是否由调用MsgSend的线程直接发送
+        bool                direct_send_;
+
+        // 是否使用EPOLLET边缘触发，开启后收包和accept都要一直处理到EAGAIN
+        bool                edge_triggered_;
+
+        // 预留的空闲fd，fd用尽时让出来accept并关掉新连接，避免连接一直堆在backlog里
+        int                 idle_fd_;
+        mutex               idle_fd_mutex_;
+
+        // 同一个连接的包是否总是交给同一个逻辑线程处理
+        bool                connection_affinity_;
+
+        // 一个数据流允许的最大字节数
+        uint32_t            max_stream_size_;
+
+        // 每个连接最多有多少个包在逻辑线程中处理，0表示不限制
+        int                 max_in_flight_;
+
+        // 过载保护有关
+        // 是否开启过载保护，关闭时只保留发送队列的上限
+        bool                overload_enable_;
+        // 线程池中等待处理的消息数达到它时进入过载状态，0表示不看线程池
+        size_t              overload_max_waiting_;
+        // 发送队列中积压的数据包达到它时进入过载状态，超过它的回包直接丢弃
+        int                 overload_max_send_backlog_;
+        // 每秒最多接受的新连接数，0表示不限制
+        int                 overload_max_accept_rate_;
+        // 积压降到阈值的这个百分比以下时退出过载状态
+        int                 overload_recover_percent_;
+        OverloadPolicy      overload_policy_;
+        // 当前是否处于过载状态
+        atomic<bool>        overloaded_;
+        // 统计接受速率的当前秒和这一秒内接受的连接数
+        atomic<int64_t>     accept_second_;
+        atomic<int>         accept_count_;
+        // 因为过载拒绝的连接数和丢掉的请求数
+        atomic<int>         rejected_accept_count_;
+        atomic<int>         shed_request_count_;
 
 
 };
@@ -0,0 +1,276 @@
+#ifndef _HAO_TASK_QUEUE_H_
+#define _HAO_TASK_QUEUE_H_
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// 类型擦除的任务，小对象直接放在内部的缓冲区中，不用分配内存
+// 线程池中的任务一般是成员函数指针+对象指针+消息指针，都能放得下
+class Task
+{
+    public:
+        static constexpr std::size_t kInlineSize{48};
+
+        Task() = default;
+
+        template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+        Task(F&& function)
+        {
+            using Function = std::decay_t<F>;
+            if constexpr(sizeof(Function) <= kInlineSize && alignof(Function) <= alignof(std::max_align_t)
+                        && std::is_nothrow_move_constructible_v<Function>)
+            {
+                new(storage_) Function(std::forward<F>(function));
+                ops_ = &kInlineOps<Function>;
+            }
+            else
+            {
+                // 放不下的才到堆上
+                new(storage_) Function*(new Function(std::forward<F>(function)));
+                ops_ = &kHeapOps<Function>;
+            }
+        }
+
+        Task(Task&& other) noexcept
+        {
+            MoveFrom(other);
+        }
+
+        Task& operator=(Task&& other) noexcept
+        {
+            if(this != &other)
+            {
+                Reset();
+                MoveFrom(other);
+            }
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task()
+        {
+            Reset();
+        }
+
+        explicit operator bool() const
+        {
+            return ops_ != nullptr;
+        }
+
+        void operator()()
+        {
+            ops_->invoke(storage_);
+        }
+
+        void Reset()
+        {
+            if(ops_ != nullptr)
+            {
+                ops_->destroy(storage_);
+                ops_ = nullptr;
+            }
+        }
+
+    private:
+        struct Ops
+        {
+            void (*invoke)(void* storage);
+            // 把src中的对象移动到dst，并析构src中的对象
+            void (*move)(void* dst, void* src);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename Function>
+        static constexpr Ops kInlineOps{
+            [](void* storage){ (*static_cast<Function*>(storage))(); },
+            [](void* dst, void* src)
+            {
+                Function* from = static_cast<Function*>(src);
+                new(dst) Function(std::move(*from));
+                from->~Function();
+            },
+            [](void* storage){ static_cast<Function*>(storage)->~Function(); }
+        };
+
+        template <typename Function>
+        static constexpr Ops kHeapOps{
+            [](void* storage){ (**static_cast<Function**>(storage))(); },
+            [](void* dst, void* src){ new(dst) Function*(*static_cast<Function**>(src)); },
+            [](void* storage){ delete *static_cast<Function**>(storage); }
+        };
+
+        void MoveFrom(Task& other)
+        {
+            ops_ = other.ops_;
+            if(ops_ != nullptr)
+            {
+                ops_->move(storage_, other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+
+        alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+        const Ops* ops_{nullptr};
+};
+
+// 有界无锁多生产者多消费者环形队列(Dmitry Vyukov的算法)
+// 每个槽有一个序号，生产者和消费者各自用CAS抢位置，抢到后只操作自己的槽
+class TaskRing
+{
+    public:
+        explicit TaskRing(std::size_t capacity)
+            :mask_{RoundUp(capacity) - 1},
+            cells_{std::make_unique<Cell[]>(mask_ + 1)}
+        {
+            for(std::size_t i = 0; i <= mask_; ++i)
+            {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        TaskRing(const TaskRing&) = delete;
+        TaskRing& operator=(const TaskRing&) = delete;
+
+        // 队列满了返回false，task保持不变
+        bool TryPush(Task& task)
+        {
+            Cell* cell{nullptr};
+            std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                cell = &cells_[pos & mask_];
+                std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if(diff == 0)
+                {
+                    if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if(diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            cell->task = std::move(task);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // 一次占用多个连续的空槽，返回实际放进去的个数，放进去的task被移走
+        std::size_t TryPushBulk(Task* tasks, std::size_t count)
+        {
+            std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                // 空槽的序号等于它的位置，空槽在写入之前不会被别人改动
+                std::size_t free_cells{0};
+                while(free_cells < count
+                    && cells_[(pos + free_cells) & mask_].sequence.load(std::memory_order_acquire) == pos + free_cells)
+                {
+                    ++free_cells;
+                }
+                if(free_cells == 0)
+                {
+                    std::size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                    if(static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos) < 0)
+                    {
+                        return 0;
+                    }
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if(enqueue_pos_.compare_exchange_weak(pos, pos + free_cells, std::memory_order_relaxed))
+                {
+                    for(std::size_t i = 0; i < free_cells; ++i)
+                    {
+                        Cell& cell = cells_[(pos + i) & mask_];
+                        cell.task = std::move(tasks[i]);
+                        cell.sequence.store(pos + i + 1, std::memory_order_release);
+                    }
+                    return free_cells;
+                }
+            }
+        }
+
+        // 队列空了返回false
+        bool TryPop(Task& task)
+        {
+            Cell* cell{nullptr};
+            std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            for(;;)
+            {
+                cell = &cells_[pos & mask_];
+                std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+                if(diff == 0)
+                {
+                    if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if(diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            task = std::move(cell->task);
+            cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+        }
+
+        // 近似的元素个数，只用于统计和判断是否要睡眠
+        std::size_t Size() const
+        {
+            std::size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+            std::size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+            return enqueue > dequeue ? enqueue - dequeue : 0;
+        }
+
+        bool Empty() const
+        {
+            return Size() == 0;
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<std::size_t>    sequence;
+            Task                        task;
+        };
+
+        static std::size_t RoundUp(std::size_t value)
+        {
+            std::size_t result{2};
+            while(result < value)
+            {
+                result <<= 1;
+            }
+            return result;
+        }
+
+        // 生产者和消费者的位置分开放在不同的缓存行，避免伪共享
+        alignas(64) std::atomic<std::size_t>    enqueue_pos_{0};
+        alignas(64) std::atomic<std::size_t>    dequeue_pos_{0};
+        alignas(64) const std::size_t           mask_;
+        std::unique_ptr<Cell[]>                 cells_;
+};
+
+#endif
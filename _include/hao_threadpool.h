@@ -2,6 +2,7 @@
 #define _HAO_THREADPOOL_H_
 
 #include <hao_timestamp.h>
+#include <hao_task_queue.h>
 
 #include <thread>
 #include <vector>
@@ -12,6 +13,7 @@
 #include <functional>
 #include <condition_variable>
 #include <future>
+#include <deque>
 
 using std::vector;
 using std::atomic;
@@ -28,7 +30,51 @@ using std::promise;
 using std::make_shared;
 using std::make_unique;
 using std::scoped_lock;
+using std::deque;
+using std::pair;
 
+class ThreadPool;
+
+// 一批任务，攒起来用ThreadPool::PushBatch一起投递，每个工作线程最多只唤醒一次
+// 投递后清空，vector的容量留着下次用
+class TaskBatch
+{
+    public:
+        template <typename F, typename... A>
+        void Add(F&& task, A&&... args)
+        {
+            shared_.emplace_back(std::bind(std::forward<F>(task), std::forward<A>(args)...));
+        }
+
+        // 和ThreadPool::PushTaskTo一样，同一个key的任务由同一个线程按顺序执行
+        template <typename F, typename... A>
+        void AddTo(size_t key, F&& task, A&&... args)
+        {
+            pinned_.emplace_back(key, Task(std::bind(std::forward<F>(task), std::forward<A>(args)...)));
+        }
+
+        bool Empty() const
+        {
+            return shared_.empty() && pinned_.empty();
+        }
+
+        size_t Size() const
+        {
+            return shared_.size() + pinned_.size();
+        }
+
+    private:
+        friend class ThreadPool;
+        vector<Task>                shared_;
+        vector<pair<size_t, Task>>  pinned_;
+        // 按线程归类固定任务时用的临时空间
+        vector<Task>                sorted_;
+        vector<size_t>              offsets_;
+};
+
+// 每个工作线程有自己的无锁任务队列，自己的队列空了就去别的线程的队列里偷任务
+// 另外每个工作线程还有一个不能被偷的固定队列，PushTaskTo按key投递到固定的线程，同一个key的任务按顺序执行
+// 任务用Task保存，小任务不分配内存
 class ThreadPool
 {
     public:
@@ -92,27 +138,66 @@ class ThreadPool
         template <typename F, typename... A>
         void PushTask(F&& task, A&&... args)
         {
-            function<void()> task_function = std::bind(std::forward<F>(task), std::forward<A>(args)...);
-            {
-                scoped_lock lock(tasks_mutex_);
-                tasks_.push(task_function);
-            }
-            ++tasks_total_;
-            task_available_cv_.notify_one();
+            Push(Task(std::bind(std::forward<F>(task), std::forward<A>(args)...)));
+        }
+
+        // 添加一个任务到key对应的固定线程，同一个key的任务总是由同一个线程按投递顺序执行
+        template <typename F, typename... A>
+        void PushTaskTo(size_t key, F&& task, A&&... args)
+        {
+            PushPinned(key, Task(std::bind(std::forward<F>(task), std::forward<A>(args)...)));
         }
+
+        // 一次投递一批任务，每个线程的队列只入队一次，每个线程最多唤醒一次，投递后batch被清空
+        void PushBatch(TaskBatch& batch);
     private:
-        
+        // 每个工作线程的队列和睡眠用的条件变量
+        struct Worker
+        {
+            explicit Worker(size_t capacity) : queue{capacity}, pinned{capacity}, pinned_overflow_count{0}, sleeping{false} {}
+            TaskRing            queue;
+            // 只有本线程会取的队列
+            TaskRing            pinned;
+            // pinned满了时放这里，不为空时新任务也要放这里，保证顺序
+            mutex               pinned_mutex;
+            deque<Task>         pinned_overflow;
+            atomic<size_t>      pinned_overflow_count;
+            mutex               sleep_mutex;
+            condition_variable  sleep_cv;
+            atomic<bool>        sleeping;
+        };
+
+        void Push(Task&& task);
+        void PushPinned(size_t key, Task&& task);
+        // 把tasks中的count个任务放进index线程的队列，放不下的放到溢出队列
+        void PushRun(concurrency_t index, Task* tasks, size_t count, bool pinned);
+        // 从自己的固定队列、自己的队列、其他线程的队列、溢出队列中依次找一个任务
+        bool TakeTask(concurrency_t index, Task& task);
+        // index线程有没有能取的任务
+        bool HasTask(concurrency_t index) const;
+        // index线程在睡眠就唤醒它
+        bool WakeWorker(concurrency_t index);
+        void WakeAll();
         void DestoryThreads();
-        void WorkerThread();
+        void WorkerThread(concurrency_t index);
         concurrency_t DetermineThreadCount(const concurrency_t thread_count);
     private:
-        condition_variable task_available_cv_;
+        // 每个工作线程队列的容量
+        static constexpr size_t kQueueCapacity{4096};
+
         condition_variable task_done_cv_;
-        queue<function<void()>> tasks_;
+        // 所有队列都满了时放这里
+        deque<Task> overflow_tasks_;
         mutable mutex tasks_mutex_;
+        atomic<size_t> overflow_count_;
         concurrency_t thread_count_;
         atomic<size_t> tasks_total_;
         unique_ptr<thread[]> threads_;
+        unique_ptr<unique_ptr<Worker>[]> workers_;
+        // 非工作线程投递任务时轮流选队列
+        atomic<size_t> next_worker_;
+        // 正在睡眠的工作线程数
+        atomic<int> idle_count_;
         atomic<bool> waiting_;
         atomic<bool> running_;
         atomic<bool> paused_;
@@ -4,43 +4,84 @@
 #include "hao_timestamp.h"
 
 #include <cstdint>
-#include <functional>
-#include <atomic>
-#include <unordered_map>
+#include <vector>
 
-using std::function;
-using std::atomic;
-using std::unordered_map;
+using std::vector;
 
-struct event;
-typedef struct min_heap
+// 定时器节点，直接嵌在使用者(如Connection)里面，加入、更新、删除都不用分配内存
+struct TimerNode
 {
-    struct event    **p;        // 动态分配的数组
-    uint32_t        n,a;        // n:数组中元素个数，a:数组大小
-}min_heap_t;
+    TimerNode   *prev{nullptr};
+    TimerNode   *next{nullptr};
+    // 到期的tick
+    int64_t     expire_tick{0};
+    // 所在的槽，level * kWheelSlots + index，-1表示不在定时器中
+    int32_t     slot{-1};
+    // 使用者数据，到期时交给使用者
+    void        *data{nullptr};
+    // 每次加入定时器都会加1，用来识别过期的TimerHandle
+    uint32_t    generation{0};
+};
+
+// 定时器句柄，TimerAdd时返回，节点被删除、到期或者重新加入后，旧句柄自动失效
+struct TimerHandle
+{
+    TimerNode   *node{nullptr};
+    uint32_t    generation{0};
+};
 
+// 分层时间轮，每层64个槽，一个tick为10ms
+// 第0层精确到tick，上层的槽到时间后整体下放到下层，加入、更新、删除都是O(1)
+// 每层用一个64位的位图记录哪些槽非空，可以很快找到下一个要处理的时间
 class Timer
 {
     public:
+        static constexpr int        kWheelBits{6};
+        static constexpr int        kWheelSlots{1 << kWheelBits};
+        static constexpr int        kWheelLevels{4};
+        static constexpr int64_t    kTickMicroseconds{10 * 1000};
+
         Timer();
         ~Timer();
-        int32_t    TimerAdd(Timestamp when, void* data);
-        bool        TimerCancel(int32_t timer_id);
-        void        Update(int32_t timer_id, Timestamp when);
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        // 加入定时器，node已经在定时器中则先删除再加入，之前的句柄失效
+        TimerHandle TimerAdd(TimerNode *node, Timestamp when, void* data);
+        // 从定时器中删除，句柄已经失效返回false
+        bool        TimerCancel(TimerHandle handle);
+        // 修改到期时间，句柄已经失效则什么都不做，返回false
+        bool        Update(TimerHandle handle, Timestamp when);
+        // node是否在定时器中
+        static bool Pending(const TimerNode *node);
+        // 句柄是否还指向定时器中的同一次加入
+        static bool Valid(TimerHandle handle);
         uint32_t    Size() const;
         bool        Empty() const;
+        // 下一次需要处理定时器的时间，可能是节点到期的时间，也可能是上层的槽要下放的时间
+        // 定时器为空时返回Timestamp::InvalidTime
         Timestamp   EarliestTime() const;
-        void*       Pop();
-        // FIXME
-        // 这里应该把释放内存的工作给外面 
+        // 把到now为止所有到期的节点取出来，放到expired中，返回的节点已经不在定时器中
+        void        Expire(Timestamp now, vector<TimerNode*>& expired);
+        // 把所有节点移出定时器
         void        Clear();
-        
 
     private:
-        min_heap_t                  min_heap_;
-        //uint32_t                    timer_id_;
-        unordered_map<int32_t, event*> ref_;
+        static int64_t ToTick(Timestamp when);
+        // 根据到期时间把节点挂到对应层的槽里
+        void        Link(TimerNode *node);
+        void        Unlink(TimerNode *node);
+        // 第level层当前的槽到时间了，把其中的节点重新挂到下层
+        void        Cascade(int level);
+
+        // 下一个要处理的tick，小于它的tick都已经处理过了
+        int64_t     current_tick_;
+        uint32_t    size_;
+        // 每个槽是一个带头结点的双向循环链表
+        TimerNode   slots_[kWheelLevels * kWheelSlots];
+        // 每层非空槽的位图
+        uint64_t    occupied_[kWheelLevels];
 };
 
 
-#endif
\ No newline at end of file
+#endif
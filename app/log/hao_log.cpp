@@ -10,6 +10,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <string>
 #include <array>
@@ -23,6 +27,12 @@
 #include <iostream>
 #include <limits>
 #include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <chrono>
 
 using namespace hao_log;
 
@@ -33,50 +43,681 @@ using std::string_view;
 using std::to_chars;
 
 
+class AsyncBackend;
+
 struct GlobalLog
 {
     int log_fd_;
     LogLevel log_level_;
+    // 异步后台，LOG_INIT时创建，之后不再释放，避免退出时还有线程在用
+    AsyncBackend* async_backend_{nullptr};
+    std::atomic<bool> async_running_{false};
+    // 取日志时间用的时钟，CLOCK_REALTIME_COARSE精度只有几毫秒，但是不用进内核也不用读tsc
+    std::atomic<clockid_t> clock_id_{CLOCK_REALTIME};
+    // 日志文件路径，轮转和重新打开时用
+    string path_;
+    // 文件超过这么多字节就轮转，0表示不按大小轮转
+    size_t rotate_size_{0};
+    // 每隔多少秒(按本地时间对齐)轮转一次，0表示不按时间轮转
+    int64_t rotate_interval_{0};
+    // 当前文件所属的时间段，只有后台线程使用
+    int64_t rotate_period_{-1};
+    // 收到SIGUSR1后置位，由后台线程(同步模式下由写日志的线程)重新打开日志文件
+    std::atomic<bool> reopen_requested_{false};
+    // 是否写二进制日志
+    std::atomic<bool> binary_{false};
+    // 日志文件的代数，每打开一个新文件加1，二进制模式下调用点的定义要在每个新文件中重新写一次
+    std::atomic<uint32_t> file_generation_{1};
 };
 
 GlobalLog global_log_;
 
-LogLevel hao_log::GetLevel()
+namespace
 {
-    return global_log_.log_level_;
+    // 把数据全部写入fd，磁盘满了就放弃
+    void WriteAll(int fd, const char* data, size_t size)
+    {
+        size_t written {0};
+        ssize_t result {0};
+        while(written < size)
+        {
+            result = write(fd, data + written, size - written);
+            if(result == -1)
+            {
+                if(errno == ENOSPC)
+                {
+                    // 磁盘空间不够了
+                    break;
+                }
+                else
+                {
+                    continue;
+                }
+            }
+            written += result;
+        }
+    }
+
+    void WriteAll(const char* data, size_t size)
+    {
+        WriteAll(global_log_.log_fd_, data, size);
+    }
+
+    // 二进制模式下新的空文件先写入魔数
+    void WriteMagicIfEmpty(int fd)
+    {
+        struct stat st;
+        if(global_log_.binary_.load(std::memory_order_relaxed)
+            && fstat(fd, &st) == 0 && st.st_size == 0)
+        {
+            WriteAll(fd, binary::kMagic, sizeof(binary::kMagic));
+        }
+    }
+
+    // 本地时间所在的轮转时间段
+    int64_t RotatePeriod(time_t now)
+    {
+        struct tm local;
+        localtime_r(&now, &local);
+        return (now + local.tm_gmtoff) / global_log_.rotate_interval_;
+    }
+
+    // 轮转后旧文件的名字：原文件名.年月日-时分秒，同一秒轮转多次时再加序号
+    string ArchiveName()
+    {
+        time_t now = time(nullptr);
+        struct tm local;
+        localtime_r(&now, &local);
+        char suffix[32];
+        strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &local);
+        string name = global_log_.path_ + suffix;
+        string candidate = name;
+        for(int i{1}; access(candidate.c_str(), F_OK) == 0; ++i)
+        {
+            candidate = name + '.' + std::to_string(i);
+        }
+        return candidate;
+    }
+
+    // 重新打开日志文件，rotate为true时先把当前文件改名
+    // 新文件用dup2原子地换到原来的fd上，其他线程不用加锁，写的要么是旧文件要么是新文件
+    void ReopenLogFile(bool rotate)
+    {
+        const int fd = global_log_.log_fd_;
+        if(fd == STDERR_FILENO || global_log_.path_.empty())
+        {
+            return;
+        }
+        // master和worker进程写的是同一个文件，用旧文件上的进程间文件锁保证只有一个进程改名，
+        // 其他进程发现路径上已经是新文件了，就只重新打开
+        // 魔数也在持有锁时写入新文件，后拿到锁的进程看到的文件已经不是空的了
+        struct flock lock;
+        std::memset(&lock, 0, sizeof(lock));
+        lock.l_whence = SEEK_SET;
+        lock.l_len = 1;
+        lock.l_type = F_WRLCK;
+        fcntl(fd, F_SETLKW, &lock);
+        if(rotate)
+        {
+            struct stat opened, on_disk;
+            if(fstat(fd, &opened) == 0 && stat(global_log_.path_.c_str(), &on_disk) == 0
+                && opened.st_ino == on_disk.st_ino && opened.st_dev == on_disk.st_dev)
+            {
+                rename(global_log_.path_.c_str(), ArchiveName().c_str());
+            }
+        }
+        int new_fd = open(global_log_.path_.c_str(), O_RDWR | O_APPEND | O_CREAT, 0666);
+        if(new_fd == -1)
+        {
+            lock.l_type = F_UNLCK;
+            fcntl(fd, F_SETLK, &lock);
+            return;
+        }
+        WriteMagicIfEmpty(new_fd);
+        // 旧文件在fd上关闭时，上面加的锁也随之释放
+        dup2(new_fd, fd);
+        close(new_fd);
+        global_log_.file_generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 后台线程每一轮写文件前调用，检查是否需要轮转或者重新打开
+    void MaintainLogFile()
+    {
+        bool reopen = global_log_.reopen_requested_.exchange(false, std::memory_order_acq_rel);
+        bool rotate{false};
+        if(global_log_.rotate_size_ > 0)
+        {
+            // 用fstat取文件大小，其他进程写的也算在内
+            struct stat st;
+            rotate = fstat(global_log_.log_fd_, &st) == 0 && static_cast<size_t>(st.st_size) >= global_log_.rotate_size_;
+        }
+        if(global_log_.rotate_interval_ > 0)
+        {
+            int64_t period = RotatePeriod(time(nullptr));
+            if(global_log_.rotate_period_ != -1 && period != global_log_.rotate_period_)
+            {
+                rotate = true;
+            }
+            global_log_.rotate_period_ = period;
+        }
+        if(reopen || rotate)
+        {
+            ReopenLogFile(rotate);
+        }
+    }
+
+    // 每个线程一个的暂存缓冲区，单生产者(所属线程)单消费者(后台线程)的无锁环形缓冲区
+    // 一条日志要么完整写入，要么整条丢弃，不会被截断
+    class StagingBuffer
+    {
+        public:
+            explicit StagingBuffer(size_t capacity)
+                :capacity_{RoundUp(capacity)}, mask_{capacity_ - 1}, data_{new char[capacity_]}
+            {
+
+            }
+
+            // 所属线程调用，空间不够返回false
+            bool TryWrite(const char* src, size_t len)
+            {
+                size_t head = head_.load(std::memory_order_relaxed);
+                size_t tail = tail_.load(std::memory_order_acquire);
+                if(capacity_ - (head - tail) < len)
+                {
+                    return false;
+                }
+                size_t offset = head & mask_;
+                size_t first = std::min(len, capacity_ - offset);
+                std::memcpy(data_.get() + offset, src, first);
+                std::memcpy(data_.get(), src + first, len - first);
+                head_.store(head + len, std::memory_order_release);
+                return true;
+            }
+
+            size_t Used() const
+            {
+                return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed);
+            }
+
+            size_t Capacity() const
+            {
+                return capacity_;
+            }
+
+            // 后台线程调用，把可读的数据(最多两段)放到iov中，返回段数，end为本次读到的位置
+            int Readable(struct iovec* iov, size_t& end) const
+            {
+                size_t tail = tail_.load(std::memory_order_relaxed);
+                end = head_.load(std::memory_order_acquire);
+                if(end == tail)
+                {
+                    return 0;
+                }
+                size_t offset = tail & mask_;
+                size_t first = std::min(end - tail, capacity_ - offset);
+                iov[0].iov_base = data_.get() + offset;
+                iov[0].iov_len = first;
+                if(first == end - tail)
+                {
+                    return 1;
+                }
+                iov[1].iov_base = data_.get();
+                iov[1].iov_len = end - tail - first;
+                return 2;
+            }
+
+            // 后台线程调用，end之前的数据已经写完了
+            void Consume(size_t end)
+            {
+                tail_.store(end, std::memory_order_release);
+            }
+
+            // 因为缓冲区满而丢弃的日志条数
+            std::atomic<uint64_t>   dropped{0};
+            // 所属线程已经退出，数据写完后由后台线程释放
+            std::atomic<bool>       retired{false};
+
+        private:
+            static size_t RoundUp(size_t value)
+            {
+                size_t result{kLogLineSize};
+                while(result < value)
+                {
+                    result <<= 1;
+                }
+                return result;
+            }
+
+            const size_t            capacity_;
+            const size_t            mask_;
+            std::unique_ptr<char[]> data_;
+            alignas(64) std::atomic<size_t> head_{0};
+            alignas(64) std::atomic<size_t> tail_{0};
+    };
+
+    thread_local StagingBuffer* tls_staging{nullptr};
+
+    // 线程退出时把缓冲区标记为退休
+    struct StagingHolder
+    {
+        bool active{false};
+        ~StagingHolder()
+        {
+            if(tls_staging != nullptr)
+            {
+                tls_staging->retired.store(true, std::memory_order_release);
+                tls_staging = nullptr;
+            }
+        }
+    };
+
+    thread_local StagingHolder tls_staging_holder;
 }
 
-constexpr const char* h_level_string(int level)
+// 异步日志后台：登记所有线程的暂存缓冲区，后台线程定期(或缓冲区过半时)把它们一起用writev写入文件
+class AsyncBackend
 {
-    return &"[      ]"      // null string
-            "[emerg ]"      // system is unusable
-            "[alert ]"      // action must be taken immediately
-            "[crit  ]"      // critical conditions
-            "[error ]"      // error conditions
-            "[warn  ]"      // warning conditions
-            "[notice]"      // normal, but significant, condition
-            "[info  ]"      // informational message
-            "[debug ]"      // debug-level message
-            [level * 8];
+    public:
+        static constexpr std::chrono::milliseconds kFlushInterval{100};
+
+        explicit AsyncBackend(size_t buffer_size)
+            :buffer_size_{buffer_size},
+            wake_cv_{std::make_unique<std::condition_variable>()}
+        {
+
+        }
+
+        void Start()
+        {
+            running_ = true;
+            // 后台线程屏蔽所有信号，信号仍由原来的线程处理
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old);
+            flusher_ = std::make_unique<std::thread>(&AsyncBackend::FlushThread, this);
+            pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        }
+
+        // 停止后台线程并把剩下的日志写完
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock{wake_mutex_};
+                running_ = false;
+            }
+            wake_cv_->notify_one();
+            if(flusher_ && flusher_->joinable())
+            {
+                flusher_->join();
+            }
+            std::lock_guard<std::mutex> lock{flush_mutex_};
+            FlushOnce();
+        }
+
+        // 日志线程调用，缓冲区满了丢弃这一条
+        // urgent表示CRIT及更严重的日志，之后进程可能马上崩溃，由当前线程把所有缓冲区写入文件再返回
+        void Append(const char* data, size_t size, bool urgent)
+        {
+            StagingBuffer* buffer = LocalBuffer();
+            if(urgent)
+            {
+                std::lock_guard<std::mutex> lock{flush_mutex_};
+                uint64_t dropped{0};
+                if(!buffer->TryWrite(data, size))
+                {
+                    dropped = FlushOnce();
+                    if(!buffer->TryWrite(data, size))
+                    {
+                        ++dropped;
+                    }
+                }
+                dropped += FlushOnce();
+                // 丢弃的条数记回去，由后台线程统一报告
+                if(dropped > 0)
+                {
+                    buffer->dropped.fetch_add(dropped, std::memory_order_relaxed);
+                }
+                return;
+            }
+            bool full{false};
+            if(!buffer->TryWrite(data, size))
+            {
+                buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+                full = true;
+            }
+            // 缓冲区过半或者满了时提前唤醒后台线程，同一时间只通知一次
+            if((full || buffer->Used() > buffer->Capacity() / 2)
+                && !flush_requested_.exchange(true, std::memory_order_acq_rel))
+            {
+                wake_cv_->notify_one();
+            }
+        }
+
+        // fork之前先把所有缓冲区写完并持有锁，保证子进程拿到一致的状态，父子进程都不会重复写
+        void PrepareFork()
+        {
+            flush_mutex_.lock();
+            registry_mutex_.lock();
+            wake_mutex_.lock();
+            FlushBuffers();
+        }
+
+        void ParentAfterFork()
+        {
+            wake_mutex_.unlock();
+            registry_mutex_.unlock();
+            flush_mutex_.unlock();
+        }
+
+        // 子进程中只剩下调用fork的线程，其他线程的缓冲区不再有人写，直接释放
+        // 父进程的后台线程不会出现在子进程中，重新启动一个
+        void ChildAfterFork()
+        {
+            for(StagingBuffer* buffer : buffers_)
+            {
+                if(buffer != tls_staging)
+                {
+                    delete buffer;
+                }
+            }
+            buffers_.clear();
+            if(tls_staging != nullptr)
+            {
+                buffers_.push_back(tls_staging);
+            }
+            // 原来的条件变量可能还记着父进程后台线程的等待状态，线程句柄也已经无效，都不能再用或析构
+            wake_cv_.release();
+            wake_cv_ = std::make_unique<std::condition_variable>();
+            flusher_.release();
+            flush_requested_ = false;
+            wake_mutex_.unlock();
+            registry_mutex_.unlock();
+            flush_mutex_.unlock();
+            if(running_)
+            {
+                Start();
+            }
+        }
+
+    private:
+        StagingBuffer* LocalBuffer()
+        {
+            if(tls_staging == nullptr)
+            {
+                tls_staging = new StagingBuffer(buffer_size_);
+                tls_staging_holder.active = true;
+                std::lock_guard<std::mutex> lock{registry_mutex_};
+                buffers_.push_back(tls_staging);
+            }
+            return tls_staging;
+        }
+
+        void FlushThread()
+        {
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock{wake_mutex_};
+                    wake_cv_->wait_for(lock, kFlushInterval, [this]{
+                        return !running_ || flush_requested_.load(std::memory_order_acquire);
+                    });
+                    if(!running_)
+                    {
+                        break;
+                    }
+                }
+                flush_requested_.store(false, std::memory_order_release);
+                uint64_t dropped{0};
+                {
+                    std::lock_guard<std::mutex> lock{flush_mutex_};
+                    // 轮转只在后台线程中做，不影响写日志的线程
+                    MaintainLogFile();
+                    dropped = FlushOnce();
+                }
+                if(dropped > 0)
+                {
+                    LOG_WARN << "日志缓冲区已满，丢弃了" << dropped << "条日志";
+                }
+            }
+        }
+
+        // 持有flush_mutex_时调用，释放已退休的空缓冲区，返回这段时间丢弃的日志条数
+        uint64_t FlushOnce()
+        {
+            std::lock_guard<std::mutex> lock{registry_mutex_};
+            return FlushBuffers();
+        }
+
+        // 持有flush_mutex_和registry_mutex_时调用
+        uint64_t FlushBuffers()
+        {
+            uint64_t dropped{0};
+            size_t kept{0};
+            for(size_t i{0}; i < buffers_.size(); ++i)
+            {
+                StagingBuffer* buffer = buffers_[i];
+                // 先读retired再看是否为空，退休后不会再有新数据
+                if(buffer->retired.load(std::memory_order_acquire) && buffer->Used() == 0)
+                {
+                    dropped += buffer->dropped.load(std::memory_order_relaxed);
+                    delete buffer;
+                    continue;
+                }
+                buffers_[kept++] = buffer;
+            }
+            buffers_.resize(kept);
+
+            ends_.resize(buffers_.size());
+            size_t first{0};
+            while(first < buffers_.size())
+            {
+                // 一次writev最多IOV_MAX段，每个缓冲区最多两段
+                int count{0};
+                size_t last = first;
+                while(last < buffers_.size() && count + 2 <= IOV_MAX)
+                {
+                    count += buffers_[last]->Readable(iov_ + count, ends_[last]);
+                    ++last;
+                }
+                WriteVector(iov_, count);
+                for(size_t i = first; i < last; ++i)
+                {
+                    buffers_[i]->Consume(ends_[i]);
+                    dropped += buffers_[i]->dropped.exchange(0, std::memory_order_relaxed);
+                }
+                first = last;
+            }
+            return dropped;
+        }
+
+        // 部分写入时接着写剩下的部分，不能让其他数据插到一行的中间
+        static void WriteVector(struct iovec* iov, int count)
+        {
+            while(count > 0)
+            {
+                ssize_t result = writev(global_log_.log_fd_, iov, count);
+                if(result == -1)
+                {
+                    if(errno == EINTR || errno == EAGAIN)
+                    {
+                        continue;
+                    }
+                    // 磁盘满了等错误，这一批直接放弃
+                    break;
+                }
+                size_t written = static_cast<size_t>(result);
+                while(count > 0 && written >= iov->iov_len)
+                {
+                    written -= iov->iov_len;
+                    ++iov;
+                    --count;
+                }
+                if(count > 0)
+                {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                    iov->iov_len -= written;
+                }
+            }
+        }
+
+        const size_t                buffer_size_;
+        bool                        running_{false};
+        // 保证同一时间只有一个线程在写缓冲区中的数据
+        std::mutex                  flush_mutex_;
+        // 保护buffers_
+        std::mutex                  registry_mutex_;
+        vector<StagingBuffer*>      buffers_;
+        std::mutex                  wake_mutex_;
+        std::unique_ptr<std::condition_variable> wake_cv_;
+        std::atomic<bool>           flush_requested_{false};
+        std::unique_ptr<std::thread> flusher_;
+        // 写文件时用的临时空间，只在持有flush_mutex_时使用
+        vector<size_t>              ends_;
+        struct iovec                iov_[IOV_MAX];
+};
+
+namespace
+{
+    void PrepareFork()
+    {
+        if(global_log_.async_running_.load(std::memory_order_acquire))
+        {
+            global_log_.async_backend_->PrepareFork();
+        }
+    }
+
+    void ParentAfterFork()
+    {
+        if(global_log_.async_running_.load(std::memory_order_acquire))
+        {
+            global_log_.async_backend_->ParentAfterFork();
+        }
+    }
+
+    void ChildAfterFork()
+    {
+        if(global_log_.async_running_.load(std::memory_order_acquire))
+        {
+            global_log_.async_backend_->ChildAfterFork();
+        }
+    }
+
+    // 把一条完整的日志(文本的一行或者二进制的一条记录)交给后台线程或者直接写入文件
+    void EmitRecord(const char* data, size_t size, bool urgent)
+    {
+        if(global_log_.async_running_.load(std::memory_order_acquire))
+        {
+            global_log_.async_backend_->Append(data, size, urgent);
+        }
+        else
+        {
+            // 同步模式下没有后台线程，由写日志的线程处理重新打开
+            if(global_log_.reopen_requested_.load(std::memory_order_relaxed)
+                && global_log_.reopen_requested_.exchange(false, std::memory_order_acq_rel))
+            {
+                ReopenLogFile(false);
+            }
+            WriteAll(data, size);
+        }
+    }
+
+    // 调用点的定义在当前文件中还没写过就先写一次
+    void EmitSite(LogSite& site)
+    {
+        uint32_t generation = global_log_.file_generation_.load(std::memory_order_relaxed);
+        if(site.generation.load(std::memory_order_relaxed) == generation)
+        {
+            return;
+        }
+        site.generation.store(generation, std::memory_order_relaxed);
+        char buffer[sizeof(binary::RecordHeader) + sizeof(binary::SiteRecord) + PATH_MAX];
+        size_t file_len = std::min(std::strlen(site.file), static_cast<size_t>(PATH_MAX));
+        binary::RecordHeader header{static_cast<uint16_t>(sizeof(buffer) - PATH_MAX + file_len), binary::kSiteRecord};
+        binary::SiteRecord record{site.id, site.line, static_cast<uint16_t>(file_len)};
+        std::memcpy(buffer, &header, sizeof(header));
+        std::memcpy(buffer + sizeof(header), &record, sizeof(record));
+        std::memcpy(buffer + sizeof(header) + sizeof(record), site.file, file_len);
+        EmitRecord(buffer, header.length, false);
+    }
 }
 
-void hao_log::LOG_INIT(string_view filename, LogLevel init_level)
+LogLevel hao_log::GetLevel()
+{
+    return global_log_.log_level_;
+}
+
+void hao_log::LOG_INIT(string_view filename, LogLevel init_level, bool async, size_t buffer_size)
 {
     
     global_log_.log_level_ =  init_level;
+    global_log_.path_ = filename.empty() ? "HaoServer.log" : string(filename);
     // FIXME 
     // 权限应该是可读，0644
-    global_log_.log_fd_ = open(filename.empty() ? "HaoServer.log" : filename.data(), O_RDWR | O_APPEND | O_CREAT, 0666);
+    global_log_.log_fd_ = open(global_log_.path_.c_str(), O_RDWR | O_APPEND | O_CREAT, 0666);
     if(global_log_.log_fd_ == -1)
     {
         perror("open file failed.");
         global_log_.log_fd_ = STDERR_FILENO;
     }
     printf("log fd:%d\n", global_log_.log_fd_);
+    if(async && global_log_.async_backend_ == nullptr)
+    {
+        global_log_.async_backend_ = new AsyncBackend(buffer_size);
+        global_log_.async_backend_->Start();
+        global_log_.async_running_.store(true, std::memory_order_release);
+        // worker进程是fork出来的，要在fork前后处理后台线程
+        pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+    }
+}
+
+void hao_log::LOG_USE_COARSE_CLOCK(bool coarse)
+{
+    global_log_.clock_id_.store(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, std::memory_order_relaxed);
+}
+
+void hao_log::LOG_SET_ROTATION(size_t max_bytes, int interval_seconds)
+{
+    global_log_.rotate_size_ = max_bytes;
+    global_log_.rotate_interval_ = interval_seconds > 0 ? interval_seconds : 0;
+    global_log_.rotate_period_ = -1;
+    if((max_bytes > 0 || interval_seconds > 0) && !global_log_.async_running_.load(std::memory_order_acquire))
+    {
+        // 轮转只在异步日志的后台线程中做，同步模式下配置了也不会生效
+        LOG_WARN << "配置了日志轮转，但没有开启异步日志(Log.Async)，日志文件不会轮转";
+    }
+}
+
+void hao_log::LOG_REQUEST_REOPEN()
+{
+    global_log_.reopen_requested_.store(true, std::memory_order_relaxed);
+}
+
+void hao_log::LOG_USE_BINARY(bool binary)
+{
+    global_log_.binary_.store(binary, std::memory_order_relaxed);
+    if(!binary || global_log_.log_fd_ == STDERR_FILENO)
+    {
+        return;
+    }
+    char magic[sizeof(binary::kMagic)];
+    ssize_t n = pread(global_log_.log_fd_, magic, sizeof(magic), 0);
+    if(n == 0)
+    {
+        WriteMagicIfEmpty(global_log_.log_fd_);
+    }
+    else if(n != static_cast<ssize_t>(sizeof(magic)) || std::memcmp(magic, binary::kMagic, sizeof(magic)) != 0)
+    {
+        // 已经有文本日志了，轮转出去再写
+        ReopenLogFile(true);
+    }
 }
 
 void hao_log::LOG_EXIT()
 {
+    if(global_log_.async_running_.exchange(false, std::memory_order_acq_rel))
+    {
+        global_log_.async_backend_->Stop();
+    }
     if(global_log_.log_fd_ != -1)
     {
         close(global_log_.log_fd_);
@@ -105,36 +746,61 @@ inline void format_time(char* buf, unsigned a, unsigned b, unsigned c, char sep)
     std::memcpy(buf, &timer_buffer, 8);
 }
 
-void hao_log::LOG_TO_STDERR(int err, const char * fmt, ...)
+// 每个线程缓存当前这一秒格式化好的"YYYY-MM-DD HH:MM:SS."，同一秒内只需要重新格式化微秒
+// 这样localtime_r(glibc中要加锁并读取时区)每个线程每秒最多调用一次
+namespace
 {
-    char log_line_buffer_[kLogLineSize];
-    std::memset(log_line_buffer_, 0, sizeof(log_line_buffer_));
+struct TimeCache
+{
+    time_t second{-1};
+    char prefix[20];
+};
 
-    // format time
-    timeval current_time;
-    gettimeofday(&current_time, NULL);
-    struct tm to_time;
-    localtime_r(&current_time.tv_sec, &to_time);
-    std::memcpy(log_line_buffer_ , digits2(static_cast<size_t>((1900+to_time.tm_year)/100)), 2);
-    format_time(log_line_buffer_ + 2,
-                    static_cast<unsigned>(to_time.tm_year%100), 
-                    static_cast<unsigned>(to_time.tm_mon+1), 
-                    static_cast<unsigned>(to_time.tm_mday), '-');
-    log_line_buffer_[10] = ' ';
-    format_time(log_line_buffer_ + 11, 
-                    static_cast<unsigned>(to_time.tm_hour), 
-                    static_cast<unsigned>(to_time.tm_min), 
-                    static_cast<unsigned>(to_time.tm_sec), ':');
-    log_line_buffer_[19] = '.';
-    auto usec = current_time.tv_usec;
-    char* usec_end = &log_line_buffer_[26];
+thread_local TimeCache tls_time_cache;
+
+// 在buf中写入"YYYY-MM-DD HH:MM:SS.uuuuuu "，共27个字节
+void FormatTime(char* buf)
+{
+    struct timespec now;
+    clock_gettime(global_log_.clock_id_.load(std::memory_order_relaxed), &now);
+    TimeCache& cache = tls_time_cache;
+    if(now.tv_sec != cache.second)
+    {
+        struct tm to_time;
+        localtime_r(&now.tv_sec, &to_time);
+        std::memcpy(cache.prefix, digits2(static_cast<size_t>((1900+to_time.tm_year)/100)), 2);
+        format_time(cache.prefix + 2,
+                        static_cast<unsigned>(to_time.tm_year%100),
+                        static_cast<unsigned>(to_time.tm_mon+1),
+                        static_cast<unsigned>(to_time.tm_mday), '-');
+        cache.prefix[10] = ' ';
+        format_time(cache.prefix + 11,
+                        static_cast<unsigned>(to_time.tm_hour),
+                        static_cast<unsigned>(to_time.tm_min),
+                        static_cast<unsigned>(to_time.tm_sec), ':');
+        cache.prefix[19] = '.';
+        cache.second = now.tv_sec;
+    }
+    std::memcpy(buf, cache.prefix, sizeof(cache.prefix));
+    auto usec = now.tv_nsec / 1000;
+    char* usec_end = buf + 26;
     for(int i{0}; i < 3; ++i)
     {
         usec_end -= 2;
         std::memcpy(usec_end, digits2(static_cast<size_t>(usec%100)), 2);
         usec /= 100;
     }
-    log_line_buffer_[26] = ' ';
+    buf[26] = ' ';
+}
+}
+
+void hao_log::LOG_TO_STDERR(int err, const char * fmt, ...)
+{
+    char log_line_buffer_[kLogLineSize];
+    std::memset(log_line_buffer_, 0, sizeof(log_line_buffer_));
+
+    // format time
+    FormatTime(log_line_buffer_);
 
     int i {27}, count{0};
     if(err)
@@ -159,34 +825,28 @@ void hao_log::LOG_TO_STDERR(int err, const char * fmt, ...)
     write(STDERR_FILENO, log_line_buffer_, i+count);
 }
 
-Log::Log(LogLevel level, string_view filename, unsigned int line, int err)
-    :free_space_{kLogLineSize}, cur_{log_line_buffer_}, end_{log_line_buffer_+kLogLineSize}
+Log::Log(LogLevel level, LogSite& site, int err)
+    :free_space_{kLogLineSize}, cur_{log_line_buffer_}, end_{log_line_buffer_+kLogLineSize}, level_{level},
+    binary_{global_log_.binary_.load(std::memory_order_relaxed)}
 {
-    // format time
-    timeval current_time;
-    gettimeofday(&current_time, NULL);
-    struct tm to_time;
-    localtime_r(&current_time.tv_sec, &to_time);
-    std::memcpy(log_line_buffer_ , digits2(static_cast<size_t>((1900+to_time.tm_year)/100)), 2);
-    format_time(log_line_buffer_ + 2,
-                    static_cast<unsigned>(to_time.tm_year%100), 
-                    static_cast<unsigned>(to_time.tm_mon+1), 
-                    static_cast<unsigned>(to_time.tm_mday), '-');
-    log_line_buffer_[10] = ' ';
-    format_time(log_line_buffer_ + 11, 
-                    static_cast<unsigned>(to_time.tm_hour), 
-                    static_cast<unsigned>(to_time.tm_min), 
-                    static_cast<unsigned>(to_time.tm_sec), ':');
-    log_line_buffer_[19] = '.';
-    auto usec = current_time.tv_usec;
-    char* usec_end = &log_line_buffer_[26];
-    for(int i{0}; i < 3; ++i)
+    if(binary_)
     {
-        usec_end -= 2;
-        std::memcpy(usec_end, digits2(static_cast<size_t>(usec%100)), 2);
-        usec /= 100;
+        // 只写调用点id、时间和进程号，文件名和行号在调用点定义中
+        EmitSite(site);
+        struct timespec now;
+        clock_gettime(global_log_.clock_id_.load(std::memory_order_relaxed), &now);
+        binary::LogRecord record{site.id, static_cast<int32_t>(pid),
+                                static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000,
+                                static_cast<int32_t>(err), static_cast<uint8_t>(level)};
+        // 记录头部的长度在析构时填
+        cur_ = log_line_buffer_ + sizeof(binary::RecordHeader);
+        std::memcpy(cur_, &record, sizeof(record));
+        cur_ += sizeof(record);
+        free_space_ -= sizeof(binary::RecordHeader) + sizeof(record);
+        return;
     }
-    log_line_buffer_[26] = ' ';
+    // format time
+    FormatTime(log_line_buffer_);
     cur_ = log_line_buffer_ + 27;
     free_space_ -= 27;
     
@@ -197,7 +857,7 @@ Log::Log(LogLevel level, string_view filename, unsigned int line, int err)
     Append(h_level_string(level), 8);
 
     // append [filename line]
-    *this << '[' << filename << ' ' << line << ']';
+    *this << '[' << site.file << ' ' << site.line << ']';
     
     // append errno
     if(err)
@@ -212,6 +872,33 @@ Log::Log(LogLevel level, string_view filename, unsigned int line, int err)
 
 }
 
+void Log::AppendBinary(uint8_t tag, const void* src, size_t len)
+{
+    // 放不下的参数整个丢掉
+    if(free_space_ >= len + 1)
+    {
+        *cur_++ = static_cast<char>(tag);
+        std::memcpy(cur_, src, len);
+        cur_ += len;
+        free_space_ -= len + 1;
+    }
+}
+
+void Log::AppendBinaryString(const char* src, size_t len)
+{
+    // 放不下的字符串截断
+    if(free_space_ >= 1 + sizeof(uint16_t))
+    {
+        uint16_t real = static_cast<uint16_t>(std::min(len, free_space_ - 1 - sizeof(uint16_t)));
+        *cur_++ = static_cast<char>(binary::kString);
+        std::memcpy(cur_, &real, sizeof(real));
+        cur_ += sizeof(real);
+        std::memcpy(cur_, src, real);
+        cur_ += real;
+        free_space_ -= 1 + sizeof(real) + real;
+    }
+}
+
 void Log::Append(const char* src, size_t len)
 {
     if(free_space_)
@@ -225,7 +912,12 @@ void Log::Append(const char* src, size_t len)
 
 Log& Log::operator<<(bool num)
 {
-    if(free_space_)
+    if(binary_)
+    {
+        uint8_t value = num ? 1 : 0;
+        AppendBinary(binary::kBool, &value, sizeof(value));
+    }
+    else if(free_space_)
     {
         *cur_ = num ? '1' : '0';
         ++cur_;
@@ -285,6 +977,37 @@ using uint32_or_64_t =
 template<typename T>
 void Log::FormatInteger(T num)
 {
+    if(binary_)
+    {
+        // 统一成32位或64位，解码时按标记还原
+        if constexpr(std::is_signed_v<T>)
+        {
+            if constexpr(sizeof(T) <= sizeof(int32_t))
+            {
+                int32_t value = num;
+                AppendBinary(binary::kInt32, &value, sizeof(value));
+            }
+            else
+            {
+                int64_t value = num;
+                AppendBinary(binary::kInt64, &value, sizeof(value));
+            }
+        }
+        else
+        {
+            if constexpr(sizeof(T) <= sizeof(uint32_t))
+            {
+                uint32_t value = num;
+                AppendBinary(binary::kUint32, &value, sizeof(value));
+            }
+            else
+            {
+                uint64_t value = num;
+                AppendBinary(binary::kUint64, &value, sizeof(value));
+            }
+        }
+        return;
+    }
     auto abs_value = static_cast<uint32_or_64_t<T>>(num);
     bool negative {num < 0};
     if(negative)
@@ -353,7 +1076,18 @@ Log& Log::operator<<(unsigned long long num)
 
 Log& Log::operator<<(const char* src)
 {
-    if(src)
+    if(binary_)
+    {
+        if(src)
+        {
+            AppendBinaryString(src, std::strlen(src));
+        }
+        else
+        {
+            AppendBinaryString("(null)", 6);
+        }
+    }
+    else if(src)
     {
         auto size = std::strlen(src);
         auto real = std::min(size, free_space_);
@@ -376,7 +1110,12 @@ Log& Log::operator<<(const char* src)
 Log& Log::operator<<(const void * src)
 {
     std::uintptr_t address = reinterpret_cast<uintptr_t>(src);
-    if(free_space_ >= kMaxNumericSize)
+    if(binary_)
+    {
+        uint64_t value = address;
+        AppendBinary(binary::kPointer, &value, sizeof(value));
+    }
+    else if(free_space_ >= kMaxNumericSize)
     {
         int n = std::snprintf(cur_, free_space_, "0x%" PRIXPTR, address);
         cur_ += n;
@@ -394,7 +1133,11 @@ Log& Log::operator<<(float num)
 
 Log& Log::operator<<(double num)
 {
-    if(free_space_ >= kMaxNumericSize)
+    if(binary_)
+    {
+        AppendBinary(binary::kDouble, &num, sizeof(num));
+    }
+    else if(free_space_ >= kMaxNumericSize)
     {
         int len = snprintf(cur_, kMaxNumericSize, "%.12g", num);
         cur_ += len;
@@ -406,7 +1149,11 @@ Log& Log::operator<<(double num)
 
 Log& Log::operator<<(char c)
 {
-    if(free_space_)
+    if(binary_)
+    {
+        AppendBinary(binary::kChar, &c, sizeof(c));
+    }
+    else if(free_space_)
     {
         *cur_ = c;
         ++cur_;
@@ -417,6 +1164,11 @@ Log& Log::operator<<(char c)
 
 Log& Log::operator<<(string_view sv)
 {
+    if(binary_)
+    {
+        AppendBinaryString(sv.data(), sv.size());
+        return *this;
+    }
     auto real = std::min(sv.size(), free_space_);
     std::memcpy(cur_, sv.data(), real);
     cur_ += real;
@@ -426,6 +1178,11 @@ Log& Log::operator<<(string_view sv)
 
 Log& Log::operator<<(const std::string& s)
 {
+    if(binary_)
+    {
+        AppendBinaryString(s.data(), s.size());
+        return *this;
+    }
     auto real = std::min(s.size(), free_space_);
     std::memcpy(cur_, s.c_str(), real);
     cur_ += real;
@@ -435,30 +1192,15 @@ Log& Log::operator<<(const std::string& s)
 
 Log::~Log()
 {
-    
-    if(cur_ != end_)
+    if(binary_)
     {
-        *cur_ = '\n';
-        cur_++;
+        binary::RecordHeader header{static_cast<uint16_t>(cur_ - log_line_buffer_), binary::kLogRecord};
+        std::memcpy(log_line_buffer_, &header, sizeof(header));
     }
-    size_t size = cur_ - log_line_buffer_;
-    size_t written {0};
-    ssize_t result {0};
-    while(written < size)
+    else if(cur_ != end_)
     {
-        result = write(global_log_.log_fd_, &log_line_buffer_[written], size - written);
-        if(result == -1)
-        {
-            if(errno == ENOSPC)
-            {
-                // 磁盘空间不够了
-                break;
-            }
-            else
-            {
-                continue;
-            }
-        }
-        written += result;
+        *cur_ = '\n';
+        cur_++;
     }
+    EmitRecord(log_line_buffer_, cur_ - log_line_buffer_, level_ <= LogLevel::CRIT);
 }
\ No newline at end of file
@@ -4,7 +4,8 @@
 #include "hao_memory.h"
 #include "hao_algorithm.h"
 #include "hao_log.h"
-#include "hao_logic_common.h" 
+#include "hao_logic_common.h"
+#include "hao_logic_router.h"
 
 #include <mutex>
 #include <functional>
@@ -16,21 +17,40 @@ using std::placeholders::_2;
 
 using namespace hao_log;
 
-using handler = bool(LogicSocket::*)(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length);
+// 命令码到处理函数的路由，包体长度和字节序由路由统一处理
+// 新增命令只需要在这里加一行
+using LogicRouter = Router<
+    Route<CMD_PING,     void,       &LogicSocket::HandlePing>,
+    // 业务逻辑
+    Route<CMD_REGISTER, Register,   &LogicSocket::HandleRegister>,
+    Route<CMD_LOGIN,    Login,      &LogicSocket::HandleLogin>,
+    // 流式传输
+    Route<CMD_UPLOAD,   StreamChunk, &LogicSocket::HandleUpload>
+>;
 
-static const handler status_handler[]
+namespace
 {
-    &LogicSocket::HandlePing,
-    nullptr,
-    nullptr,
-    nullptr,
-    nullptr,
-    // 业务逻辑
-    &LogicSocket::HandleRegister,
-    &LogicSocket::HandleLogin,
-};
+    // HandleMessage不管从哪里返回，都要告诉Socket这个包处理完了
+    // 消息块可能已经被释放或者交给了发送流程，所以连接和序号要先取出来
+    class RequestDoneGuard
+    {
+        public:
+            RequestDoneGuard(Connection* p_conn, uint64_t sequence_num)
+                :conn_{p_conn}, sequence_num_{sequence_num}
+            {
 
-constexpr int kTotalCommands{sizeof(status_handler)/ sizeof(handler)};
+            }
+            ~RequestDoneGuard()
+            {
+                g_socket.RequestDone(conn_, sequence_num_);
+            }
+            RequestDoneGuard(const RequestDoneGuard&) = delete;
+            RequestDoneGuard& operator=(const RequestDoneGuard&) = delete;
+        private:
+            Connection* conn_;
+            uint64_t    sequence_num_;
+    };
+}
 
 // FIXME
 // 线程池里也进行了二次bind，考虑效率问题
@@ -47,14 +67,22 @@ LogicSocket::~LogicSocket()
 // 线程池来不断的对消息队列中的消息进行处理
 void LogicSocket::HandleMessage(char *p_msg_buf)
 {
-    LOG_INFO << "到了HandleMessage里边了";
-    LOG_INFO << "要处理的消息内存地址:" << (void*)p_msg_buf;
+    LOG_TRACE << "到了HandleMessage里边了";
+    LOG_TRACE << "要处理的消息内存地址:" << (void*)p_msg_buf;
     Memory& memory = Memory::GetInstance();
     MsgHeader* p_msg_header = (MsgHeader*)p_msg_buf;
     PkgHeader* p_pkg_header = (PkgHeader*)(p_msg_buf + sizeof(MsgHeader));
     void *p_pkg_body{nullptr};
     uint16_t pkg_len = ntohs(p_pkg_header->pkg_len);
-    LOG_INFO << "得到的pkg_len为" << pkg_len;
+    LOG_TRACE << "得到的pkg_len为" << pkg_len;
+    Connection* p_conn = p_msg_header->conn;
+    RequestDoneGuard request_done{p_conn, p_msg_header->cur_sequence_num};
+    // 连接已经被回收的消息直接丢掉，不用再算校验值
+    if(p_conn->sequence_num != p_msg_header->cur_sequence_num)
+    {
+        memory.FreeMemory(p_msg_buf);
+        return;
+    }
     if(pkg_len == kPkgHeaderSize)
     {
         // 只有包头
@@ -69,151 +97,200 @@ void LogicSocket::HandleMessage(char *p_msg_buf)
     {
         // 有包体
         p_pkg_header->crc32 = ntohl(p_pkg_header->crc32);
-        LOG_INFO << "crc32值为:" << p_pkg_header->crc32;
+        LOG_TRACE << "crc32值为:" << p_pkg_header->crc32;
         // 跳过消息头，包头
         p_pkg_body = (void*)(p_msg_buf + kMsgHeaderSize + kPkgHeaderSize);
-        uint32_t calc_crc = GetCRC((unsigned char*)p_pkg_body, pkg_len-kPkgHeaderSize);
-        LOG_INFO << "计算得到的crc值为:" << calc_crc;
-        if(calc_crc != p_pkg_header->crc32)
+        // 校验算法由连接所属的监听端口决定
+        const Checksum* checksum = p_conn->listening_ptr->checksum;
+        if(!checksum->verify((unsigned char*)p_pkg_body, pkg_len-kPkgHeaderSize, p_pkg_header->crc32))
         {
-            LOG_INFO << "数据包CRC验证错误";
+            LOG_DEBUG << "数据包校验错误";
             memory.FreeMemory(p_msg_buf);
-            LOG_INFO << "这里其实应该主动关闭connection";
+            LOG_DEBUG << "这里其实应该主动关闭connection";
             return;
         }
     }
     uint16_t msg_code = ntohs(p_pkg_header->msg_code);
-    LOG_INFO << "msg_code:" << msg_code;
-    Connection* p_conn = p_msg_header->conn;
-    if(p_conn->sequence_num != p_msg_header->cur_sequence_num)
+    LOG_TRACE << "msg_code:" << msg_code;
+    HandleResult result{HandleResult::Failed};
+    if(msg_code & kStreamFlag)
     {
-        memory.FreeMemory(p_msg_buf);
+        result = HandleStreamFrame(p_conn, p_msg_header, msg_code & ~kStreamFlag, (char*)p_pkg_body, pkg_len-kPkgHeaderSize);
+    }
+    else
+    {
+        if(!LogicRouter::Registered(msg_code))
+        {
+            LOG_DEBUG << "msg_code can't find:" << msg_code;
+        }
+        LOG_TRACE << "数据全都正确了,开始具体的处理方法了";
+        result = LogicRouter::Dispatch(*this, msg_code, p_conn, p_msg_header, (char*)p_pkg_body, pkg_len-kPkgHeaderSize);
+    }
+    if(result == HandleResult::BufferTaken)
+    {
+        // 处理函数把消息块当成回包发出去了，由发送流程释放
         return;
     }
-    if(msg_code >= kTotalCommands)
+    memory.FreeMemory(p_msg_buf);
+    LOG_TRACE << "内存:" << (void*)p_msg_buf << "被释放了,没有泄漏";
+}
+
+// 分片固定在连接对应的逻辑线程上按收到的顺序处理，p_conn->stream只有这个线程会访问
+HandleResult LogicSocket::HandleStreamFrame(Connection* p_conn, MsgHeader* p_msg_header, uint16_t cmd, char* p_pkg_body, uint16_t body_length)
+{
+    StreamState& stream = p_conn->stream;
+    if(stream.active && stream.sequence_num != p_conn->sequence_num)
+    {
+        // 连接被复用之前的数据流
+        stream.active = false;
+    }
+    if(p_pkg_body == nullptr || body_length < kStreamHeaderSize)
+    {
+        LOG_DEBUG << "数据流分片太短:" << body_length;
+        stream.active = false;
+        return HandleResult::Failed;
+    }
+    StreamHeader* p_stream_header = (StreamHeader*)p_pkg_body;
+    StreamChunk chunk{p_pkg_body + kStreamHeaderSize,
+                        static_cast<uint32_t>(body_length - kStreamHeaderSize),
+                        ntohl(p_stream_header->offset),
+                        ntohl(p_stream_header->total_len)};
+    if(chunk.First())
     {
-        LOG_INFO << "msg_code can't find:" << msg_code;
+        // 新的数据流，之前没收完的直接作废
+        if(chunk.total_len == 0 || chunk.total_len > g_socket.MaxStreamSize())
+        {
+            LOG_DEBUG << "数据流长度不合法:" << chunk.total_len;
+            stream.active = false;
+            return HandleResult::Failed;
+        }
+        stream.sequence_num = p_conn->sequence_num;
+        stream.total_len = chunk.total_len;
+        stream.received = 0;
+        stream.msg_code = cmd;
+        stream.active = true;
+    }
+    else if(!stream.active || stream.msg_code != cmd || stream.total_len != chunk.total_len || stream.received != chunk.offset)
+    {
+        LOG_DEBUG << "数据流分片不连续, offset:" << chunk.offset << " 期望:" << stream.received;
+        stream.active = false;
+        return HandleResult::Failed;
+    }
+    if(chunk.length > stream.total_len - stream.received)
+    {
+        LOG_DEBUG << "数据流分片超出了总长度";
+        stream.active = false;
+        return HandleResult::Failed;
+    }
+    stream.received += chunk.length;
+    if(chunk.Last())
+    {
+        stream.active = false;
+    }
+    HandleResult result = LogicRouter::Dispatch(*this, cmd, p_conn, p_msg_header, p_pkg_body, body_length, &chunk);
+    if(result == HandleResult::Failed)
+    {
+        stream.active = false;
+    }
+    return result;
+}
 
+std::unique_lock<std::mutex> LogicSocket::LockConnection(Connection* p_conn)
+{
+    if(g_socket.ConnectionAffinity())
+    {
+        return std::unique_lock<std::mutex>{p_conn->logic_proc_mutex, std::defer_lock};
     }
-    LOG_INFO << "数据全都正确了,开始具体的处理方法了";
-    (this->*status_handler[msg_code])(p_conn, p_msg_header, (char*)p_pkg_body, pkg_len-kPkgHeaderSize);
-    Memory& mem_instance = Memory::GetInstance();
-    mem_instance.FreeMemory(p_msg_buf); 
-    LOG_INFO << "内存:" << (void*)p_msg_buf << "被释放了,没有泄漏";
+    return std::unique_lock<std::mutex>{p_conn->logic_proc_mutex};
 }
 
-bool LogicSocket::HandleRegister(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length)
+// 把收到的消息块原地改成回包发出去，消息头和包体都不用拷贝
+// 包体没有改动时，HandleMessage验证过的校验值就是回包的校验值，不用再算一遍
+HandleResult LogicSocket::ReplyInPlace(Connection* p_conn, MsgHeader* p_msg_header, uint16_t msg_code, uint16_t body_length, bool body_modified)
 {
-    LOG_INFO << "到了HandleRegister中";
-    if(p_pkg_body == nullptr)
-    {
-        return false;
-    }
-    int recv_len = sizeof(Register);
-    if(recv_len != body_length)
-    {
-        return false;
-    }
-    lock_guard<mutex> logic_mutex{p_conn->logic_proc_mutex};
-    Register *p_recv_info = (Register*)p_pkg_body;
-    p_recv_info->type = ntohl(p_recv_info->type);
-    LOG_INFO << "username size  :" << sizeof(p_recv_info->username);
-    LOG_INFO << "username strlen:" << strlen(p_recv_info->username);
-    LOG_INFO << "password size  :" << sizeof(p_recv_info->password);
-    LOG_INFO << "password strlen:" << strlen(p_recv_info->password);
-    // LOG_INFO << "type:" << p_recv_info->type;
-    // LOG_INFO << "username:" << p_recv_info->username;
-    // LOG_INFO << "password:" << p_recv_info->password;
+    char* p_send_buf = (char*)p_msg_header;
+    PkgHeader* p_pkg_header = (PkgHeader*)(p_send_buf + kMsgHeaderSize);
+    p_pkg_header->msg_code = htons(msg_code);
+    p_pkg_header->pkg_len = htons(kPkgHeaderSize + body_length);
+    uint32_t crc32 = p_pkg_header->crc32;
+    if(body_modified)
+    {
+        crc32 = p_conn->listening_ptr->checksum->compute((unsigned char*)(p_send_buf + kMsgHeaderSize + kPkgHeaderSize), body_length);
+    }
+    p_pkg_header->crc32 = htonl(crc32);
+    LOG_TRACE << "要发送包的crc32:" << crc32;
+    // 消息块交给发送流程，由它负责释放
+    g_socket.MsgSend(p_send_buf);
+    return HandleResult::BufferTaken;
+}
+
+HandleResult LogicSocket::HandleRegister(Connection* p_conn, MsgHeader* p_msg_header, Register* p_recv_info)
+{
+    LOG_TRACE << "到了HandleRegister中";
+    auto logic_mutex = LockConnection(p_conn);
+    LOG_TRACE << "username size  :" << sizeof(p_recv_info->username);
+    LOG_TRACE << "username strlen:" << strnlen(p_recv_info->username, sizeof(p_recv_info->username));
+    LOG_TRACE << "password size  :" << sizeof(p_recv_info->password);
+    LOG_TRACE << "password strlen:" << strnlen(p_recv_info->password, sizeof(p_recv_info->password));
     // 保证数据的绝对安全，如果名字超过了数组长度，要手动把数组最后一位设置为0
     // 这样也会改变发送到客户端的crc的值
+    bool body_modified = p_recv_info->username[sizeof(p_recv_info->username)-1] != 0
+                        || p_recv_info->password[sizeof(p_recv_info->password)-1] != 0;
     p_recv_info->username[sizeof(p_recv_info->username)-1]= 0;
     p_recv_info->password[sizeof(p_recv_info->password)-1]= 0;
-    LOG_INFO << "type:" << p_recv_info->type;
-    LOG_INFO << "username:" << p_recv_info->username;
-    LOG_INFO << "password:" << p_recv_info->password;
+    LOG_TRACE << "type:" << p_recv_info->type;
+    LOG_TRACE << "username:" << p_recv_info->username;
+    LOG_TRACE << "password:" << p_recv_info->password;
 
-    Memory& memory = Memory::GetInstance();
-    int send_len = sizeof(Register);
-    char *p_send_buf = (char*)memory.AllocMemory(kMsgHeaderSize+kPkgHeaderSize+send_len,true);
-    LOG_INFO << "发送消息的内存块地址:" << (void*)p_send_buf;
-    // 填充消息头
-    memcpy(p_send_buf, p_msg_header, kMsgHeaderSize);
-    PkgHeader* p_pkg_header = (PkgHeader*)(p_send_buf+kMsgHeaderSize);
-    p_pkg_header->msg_code = htons(CMD_REGISTER);
-    p_pkg_header->pkg_len = htons(kPkgHeaderSize+send_len);
-
-    // 填充消息体
-    Register* p_send_info = (Register*)(p_send_buf+kMsgHeaderSize+kPkgHeaderSize);
-    // 把消息原封不动的发送回去
-    p_recv_info->type = htonl(p_recv_info->type);
-    memcpy(p_send_info, p_recv_info, sizeof(Register));
-    p_pkg_header->crc32 = htonl(GetCRC((unsigned char*)p_send_info, send_len));
-    LOG_INFO << "要发送包的crc32:" << ntohl(p_pkg_header->crc32);
-    
-    // 把数据包发送出去
-    g_socket.MsgSend(p_send_buf);
-    return true;
+    // 把消息原封不动的发送回去，直接复用收到的消息块
+    HostToNetwork(*p_recv_info);
+    return ReplyInPlace(p_conn, p_msg_header, CMD_REGISTER, sizeof(Register), body_modified);
 }
-bool LogicSocket::HandleLogin(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length)
+HandleResult LogicSocket::HandleLogin(Connection* p_conn, MsgHeader* p_msg_header, Login* p_recv_info)
 {
-    LOG_INFO << "到了HandleLogin中";
-    if(p_pkg_body == nullptr)
-    {
-        return false;
-    }
-    int recv_len = sizeof(Login);
-    if(recv_len != body_length)
-    {
-        return false;
-    }
-    lock_guard<mutex> logic_mutex{p_conn->logic_proc_mutex};
-    Login *p_recv_info = (Login*)p_pkg_body;
-    LOG_INFO << "登陆的信息:";
-    LOG_INFO << "username size  :" << sizeof(p_recv_info->username);
-    LOG_INFO << "username strlen:" << strlen(p_recv_info->username);
-    LOG_INFO << "password size  :" << sizeof(p_recv_info->password);
-    LOG_INFO << "password strlen:" << strlen(p_recv_info->password);
-    // LOG_INFO << "type:" << p_recv_info->type;
-    // LOG_INFO << "username:" << p_recv_info->username;
-    // LOG_INFO << "password:" << p_recv_info->password;
+    LOG_TRACE << "到了HandleLogin中";
+    auto logic_mutex = LockConnection(p_conn);
+    LOG_TRACE << "登陆的信息:";
+    LOG_TRACE << "username size  :" << sizeof(p_recv_info->username);
+    LOG_TRACE << "username strlen:" << strnlen(p_recv_info->username, sizeof(p_recv_info->username));
+    LOG_TRACE << "password size  :" << sizeof(p_recv_info->password);
+    LOG_TRACE << "password strlen:" << strnlen(p_recv_info->password, sizeof(p_recv_info->password));
     // 保证数据的绝对安全，如果名字超过了数组长度，要手动把数组最后一位设置为0
     // 这样也会改变发送到客户端的crc的值
+    bool body_modified = p_recv_info->username[sizeof(p_recv_info->username)-1] != 0
+                        || p_recv_info->password[sizeof(p_recv_info->password)-1] != 0;
     p_recv_info->username[sizeof(p_recv_info->username)-1]= 0;
     p_recv_info->password[sizeof(p_recv_info->password)-1]= 0;
-    LOG_INFO << "username:" << p_recv_info->username;
-    LOG_INFO << "password:" << p_recv_info->password;
+    LOG_TRACE << "username:" << p_recv_info->username;
+    LOG_TRACE << "password:" << p_recv_info->password;
 
-    Memory& memory = Memory::GetInstance();
-    int send_len = sizeof(Login);
-    char *p_send_buf = (char*)memory.AllocMemory(kMsgHeaderSize+kPkgHeaderSize+send_len,true);
-    LOG_INFO << "发送消息的内存块地址:" << (void*)p_send_buf;
-    // 填充消息头
-    memcpy(p_send_buf, p_msg_header, kMsgHeaderSize);
-    PkgHeader* p_pkg_header = (PkgHeader*)(p_send_buf+kMsgHeaderSize);
-    p_pkg_header->msg_code = htons(CMD_LOGIN);
-    p_pkg_header->pkg_len = htons(kPkgHeaderSize+send_len);
-
-    // 填充消息体
-    Login* p_send_info = (Login*)(p_send_buf+kMsgHeaderSize+kPkgHeaderSize);
-    // 把消息原封不动的发送回去
-    memcpy(p_send_info, p_recv_info, sizeof(Login));
-    p_pkg_header->crc32 = htonl(GetCRC((unsigned char*)p_send_info, send_len));
-    LOG_INFO << "要发送包的crc32:" << ntohl(p_pkg_header->crc32);
-    
-    // 把数据包发送出去
-    g_socket.MsgSend(p_send_buf);
-    LOG_INFO << "登陆成功";
-    return true;
+    // 把消息原封不动的发送回去，直接复用收到的消息块
+    HandleResult result = ReplyInPlace(p_conn, p_msg_header, CMD_LOGIN, sizeof(Login), body_modified);
+    LOG_DEBUG << "登陆成功";
+    return result;
 }
-bool LogicSocket::HandlePing(Connection* p_conn, MsgHeader* p_msg_header, char* p_pkg_body, uint16_t body_length)
+// 示例的流式上传，只统计长度，最后一片收完后把总长度回给客户端
+// 分片已经保证了顺序，这里没有访问连接上的其他数据，不用加连接锁
+HandleResult LogicSocket::HandleUpload(Connection* p_conn, MsgHeader* p_msg_header, const StreamChunk& chunk)
 {
-    // 心跳包不可以有包体
-    if(body_length != 0)
+    LOG_TRACE << "收到数据流分片 offset:" << chunk.offset << " length:" << chunk.length << " total:" << chunk.total_len;
+    if(!chunk.Last())
     {
-        return false;
+        return HandleResult::Done;
     }
+    // 分片至少有一个StreamHeader，回包的包体放得下
+    static_assert(sizeof(UploadResult) <= kStreamHeaderSize);
+    UploadResult* p_send_info = (UploadResult*)((char*)p_msg_header + kMsgHeaderSize + kPkgHeaderSize);
+    p_send_info->total_len = chunk.total_len;
+    HostToNetwork(*p_send_info);
+    return ReplyInPlace(p_conn, p_msg_header, CMD_UPLOAD, sizeof(UploadResult), true);
+}
+
+// 心跳包不可以有包体，路由已经检查过了
+HandleResult LogicSocket::HandlePing(Connection* p_conn, MsgHeader* p_msg_header)
+{
     g_socket.UpdateTimer(p_conn, Timestamp::now());
-    return true;
+    return HandleResult::Done;
 }
 
 void SendBodyPkgToClient(MsgHeader* p_msg_header, unsigned short msg_code)
@@ -5,48 +5,92 @@
 #include "hao_memory.h"
 #include "hao_global.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
+#include <algorithm>
 #include <mutex>
 using std::lock_guard;
 using std::unique_lock;
+using std::scoped_lock;
 
 using namespace hao_log;
 Socket::Socket():
-    running_{false},                                        // 默认进程没有运行  
+    pkg_header_len_                 {kPkgHeaderSize},    // 包头的大小
+    msg_header_len_                 {kMsgHeaderSize},    // 消息头的大小
     worker_connections_             {1024},                 // 单进程最大连接数
     listen_port_count_              {1},                    // 监听端口数
+    event_loop_threads_             {1},                    // 每个进程的反应堆个数
+    running_{false},                                        // 默认进程没有运行  
+    send_backlog_count_             {0},                    // 发送队列中积压的数据包量
     recycle_connection_wait_time_   {60},                   // 回收连接等待的秒数
-    epoll_handle_                   {-1},                   // epoll_fd
-    pkg_header_len_                 {kPkgHeaderSize},    // 包头的大小
-    msg_header_len_                 {kMsgHeaderSize},    // 消息头的大小
-    discard_send_pkg_count_         {0},                    // 丢弃的数据包量
     online_user_count_              {0},                    // 在线用户数量
-    last_print_time_                {0}                     // 上次打印统计信息的时间
+    last_print_time_                {0},                    // 上次打印统计信息的时间
+    print_info_interval_            {10},                   // 打印统计信息的间隔秒数
+    discard_send_pkg_count_         {0},                    // 丢弃的数据包量
+    direct_send_                    {false},                // 默认不在逻辑线程中直接发送
+    edge_triggered_                 {false},                // 默认水平触发
+    idle_fd_                        {-1},                   // Initialize中打开
+    connection_affinity_            {false},                // 默认任意逻辑线程处理
+    max_stream_size_                {0},                    // 默认不接受流式传输
+    max_in_flight_                  {0},                    // 默认不限制在处理中的包数
+    overload_enable_                {false},                // 默认不开启过载保护
+    overload_max_waiting_           {0},                    // 默认不看线程池的积压
+    overload_max_send_backlog_      {50000},                // 发送队列的上限
+    overload_max_accept_rate_       {0},                    // 默认不限制接受速率
+    overload_recover_percent_       {80},                   // 积压降到阈值的80%以下退出过载状态
+    overload_policy_                {OverloadPolicy::Busy}, // 默认回CMD_BUSY
+    overloaded_                     {false},                // 没有过载
+    accept_second_                  {0},
+    accept_count_                   {0},
+    rejected_accept_count_          {0},                    // 因为过载拒绝的连接数
+    shed_request_count_             {0}                     // 因为过载丢掉的请求数
 {
     
 }
 Socket::Socket(MessageCallback message_callback, PingOutCallback ping_out_callback):
     message_callback_{move(message_callback)},
     ping_out_callback_{move(ping_out_callback)},
-    running_{false},                                        // 默认进程没有运行  
+    pkg_header_len_                 {kPkgHeaderSize},    // 包头的大小
+    msg_header_len_                 {kMsgHeaderSize},    // 消息头的大小
     worker_connections_             {1024},                 // 单进程最大连接数
     listen_port_count_              {1},                    // 监听端口数
+    event_loop_threads_             {1},                    // 每个进程的反应堆个数
+    running_{false},                                        // 默认进程没有运行  
+    send_backlog_count_             {0},                    // 发送队列中积压的数据包量
     recycle_connection_wait_time_   {60},                   // 回收连接等待的秒数
-    epoll_handle_                   {-1},                   // epoll_fd
-    pkg_header_len_                 {kPkgHeaderSize},    // 包头的大小
-    msg_header_len_                 {kMsgHeaderSize},    // 消息头的大小
-    discard_send_pkg_count_         {0},                    // 丢弃的数据包量
     online_user_count_              {0},                    // 在线用户数量
-    last_print_time_                {0}                     // 上次打印统计信息的时间
+    last_print_time_                {0},                    // 上次打印统计信息的时间
+    print_info_interval_            {10},                   // 打印统计信息的间隔秒数
+    discard_send_pkg_count_         {0},                    // 丢弃的数据包量
+    direct_send_                    {false},                // 默认不在逻辑线程中直接发送
+    edge_triggered_                 {false},                // 默认水平触发
+    idle_fd_                        {-1},                   // Initialize中打开
+    connection_affinity_            {false},                // 默认任意逻辑线程处理
+    max_stream_size_                {0},                    // 默认不接受流式传输
+    max_in_flight_                  {0},                    // 默认不限制在处理中的包数
+    overload_enable_                {false},                // 默认不开启过载保护
+    overload_max_waiting_           {0},                    // 默认不看线程池的积压
+    overload_max_send_backlog_      {50000},                // 发送队列的上限
+    overload_max_accept_rate_       {0},                    // 默认不限制接受速率
+    overload_recover_percent_       {80},                   // 积压降到阈值的80%以下退出过载状态
+    overload_policy_                {OverloadPolicy::Busy}, // 默认回CMD_BUSY
+    overloaded_                     {false},                // 没有过载
+    accept_second_                  {0},
+    accept_count_                   {0},
+    rejected_accept_count_          {0},                    // 因为过载拒绝的连接数
+    shed_request_count_             {0}                     // 因为过载丢掉的请求数
 {
 
 }
 
 Socket::~Socket()
 {
-    
+    if(idle_fd_ != -1)
+    {
+        close(idle_fd_);
+    }
 }
 
 // 初始化函数，fork之前调用
@@ -54,8 +98,22 @@ bool Socket::Initialize()
 {
     // 读配置文件
     ReadConfig();
-    
-    return OpenListeningSockets();
+
+    idle_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(idle_fd_ == -1)
+    {
+        LOG_ERROR << "Socket::Initialize()打开预留的空闲fd失败";
+    }
+
+    for(int i = 0; i < event_loop_threads_; ++i)
+    {
+        event_loops_.push_back(make_unique<EventLoop>(i));
+        if(!OpenListeningSockets(event_loops_.back().get()))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Socket::ReadConfig()
@@ -66,6 +124,39 @@ void Socket::ReadConfig()
     ifkickTimeCount                 = static_cast<bool>(config["Net"]["WaitTimeEnable"]);
     wait_time_                      = seconds(std::max(5, (int)config["Net"]["MaxWaitTime"]));
     ifTimeOutKick                   = static_cast<bool>(config["Net"]["TimeOutKick"]);
+    event_loop_threads_             = std::max(1, static_cast<int>(config["Net"]["EventLoopThreads"]));
+    direct_send_                    = static_cast<bool>(config["Net"]["DirectSend"]);
+    edge_triggered_                 = static_cast<bool>(config["Net"]["EdgeTriggered"]);
+    connection_affinity_            = static_cast<bool>(config["Process"]["ConnectionAffinity"]);
+    // 配置单位是MB，包头里的长度是32位的
+    max_stream_size_                = static_cast<uint32_t>(std::clamp(static_cast<int>(config["Net"]["MaxStreamSize"]), 0, 4095)) * 1024 * 1024;
+    max_in_flight_                  = std::max(0, static_cast<int>(config["Net"]["MaxInFlightPerConnection"]));
+
+    overload_enable_                = static_cast<bool>(config["Overload"]["Enable"]);
+    overload_max_waiting_           = static_cast<size_t>(std::max(0, static_cast<int>(config["Overload"]["MaxWaitingTasks"])));
+    // 没有配置时保持原来的50000
+    int max_send_backlog            = static_cast<int>(config["Overload"]["MaxSendBacklog"]);
+    overload_max_send_backlog_      = max_send_backlog > 0 ? max_send_backlog : 50000;
+    overload_max_accept_rate_       = std::max(0, static_cast<int>(config["Overload"]["MaxAcceptPerSecond"]));
+    overload_recover_percent_       = std::clamp(static_cast<int>(config["Overload"]["RecoverPercent"]), 1, 100);
+    string_view policy              = static_cast<string_view>(config["Overload"]["Policy"]);
+    if(policy == "drop")
+    {
+        overload_policy_ = OverloadPolicy::Drop;
+    }
+    else if(policy == "pause")
+    {
+        overload_policy_ = OverloadPolicy::Pause;
+    }
+    else
+    {
+        if(!policy.empty() && policy != "busy")
+        {
+            LOG_WARN << "不认识的过载处理方式:" << policy << "，使用busy";
+        }
+        overload_policy_ = OverloadPolicy::Busy;
+    }
+    print_info_interval_            = seconds(std::max(0, static_cast<int>(config["Log"]["PrintInfoInterval"])));
     
     flood_ak_enable_                = static_cast<bool>(config["Security"]["FloodAttackKickEnable"]);
     flood_time_interval_            = std::chrono::milliseconds(static_cast<int>(config["Security"]["FloodTimeInterval"]));
@@ -73,7 +164,7 @@ void Socket::ReadConfig()
     LOG_INFO << "配置项加载完毕";
 }
 
-bool Socket::OpenListeningSockets()
+bool Socket::OpenListeningSockets(EventLoop *loop)
 {
     struct sockaddr_in server_address;
     MemZero(&server_address, sizeof(server_address));
@@ -86,6 +177,14 @@ bool Socket::OpenListeningSockets()
         IpType ip_type = (bool)config["Net"]["Listen"][i]["ipv4"]?IpType::Ipv4:IpType::Ipv6;
         InternetAddress address {static_cast<uint16_t>((int)config["Net"]["Listen"][i]["ListenPort"]), address_type, ip_type};
         LOG_INFO << address.ToIPPort();
+        string_view checksum_name = static_cast<string_view>(config["Net"]["Listen"][i]["Checksum"]);
+        const Checksum* checksum = FindChecksum(checksum_name);
+        if(checksum == nullptr)
+        {
+            LOG_ERROR << "Epoll::OpenListeningSockets()::不支持的校验算法:" << checksum_name;
+            return false;
+        }
+        LOG_INFO << "校验算法:" << checksum->name;
         int socket_fd = ::socket(address.Family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
         if(-1 == socket_fd )
         {
@@ -121,7 +220,7 @@ bool Socket::OpenListeningSockets()
             close(socket_fd);
             return false;
         }
-        listen_socket_list_.emplace_back(socket_fd, address);
+        loop->listen_socket_list.emplace_back(socket_fd, address, checksum);
     }
     LOG_INFO << "监听成功";
     return true;
@@ -139,10 +238,13 @@ bool Socket::SetNonBlocking(int sock_fd)
 
 void Socket::CloseListeningSockets()
 {
-    for(int i = 0; i < listen_socket_list_.size(); i++)
+    for(auto& loop : event_loops_)
     {
-        close(listen_socket_list_[i].sockfd);
-        LOG_INFO << "关闭监听端口"  << listen_socket_list_[i].listen_address.Port();
+        for(auto& listening : loop->listen_socket_list)
+        {
+            close(listening.sockfd);
+            LOG_INFO << "关闭监听端口"  << listening.listen_address.Port();
+        }
     }
 }
 
@@ -158,43 +260,53 @@ void Socket::set_ping_out_callback(PingOutCallback ping_out_callback)
 
 int Socket::Epoll_init()
 {
-    epoll_handle_ = epoll_create1(EPOLL_CLOEXEC);
-    if(epoll_handle_ == -1)
-    {
-        LOG_ERROR << "Socket::Epoll_init()::Epoll_init() failed";
-        exit(EXIT_FAILURE);
-    }
-    LOG_INFO << pid << "创建的epoll_fd:" << epoll_handle_;
     InitConnectionPool();
-    LOG_INFO << "要监听的端口数目:" << listen_socket_list_.size();
-    for(auto it = listen_socket_list_.begin(); it != listen_socket_list_.end(); ++it)
+    for(auto& loop : event_loops_)
     {
-        Connection* p_conn = GetConnection((*it).sockfd);
-        if(p_conn == nullptr)
+        loop->epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epoll_handle == -1)
         {
-            LOG_ERROR << "Socket::Epoll_init()::GetConnection() failed";
+            LOG_ERROR << "Socket::Epoll_init()::Epoll_init() failed";
             exit(EXIT_FAILURE);
         }
-        p_conn->listening_ptr = &(*it);
-        (*it).connection_ptr = p_conn;
-        p_conn->read_handler = &Socket::EventAccept;
-        LOG_INFO << "要把fd:" << (*it).sockfd << "添加到epoll中";
-        if(Epoll_Oper_Event(
-            (*it).sockfd,
-            EPOLL_CTL_ADD,
-            EPOLLIN | EPOLLRDHUP,
-            0,
-            p_conn
-            ) == -1)
+        LOG_INFO << pid << "第" << loop->index << "个反应堆创建的epoll_fd:" << loop->epoll_handle;
+        LOG_INFO << "要监听的端口数目:" << loop->listen_socket_list.size();
+        for(auto it = loop->listen_socket_list.begin(); it != loop->listen_socket_list.end(); ++it)
         {
-            exit(EXIT_FAILURE);
+            Connection* p_conn = GetConnection((*it).sockfd);
+            if(p_conn == nullptr)
+            {
+                LOG_ERROR << "Socket::Epoll_init()::GetConnection() failed";
+                exit(EXIT_FAILURE);
+            }
+            p_conn->listening_ptr = &(*it);
+            p_conn->loop = loop.get();
+            (*it).connection_ptr = p_conn;
+            p_conn->read_handler = &Socket::EventAccept;
+            LOG_INFO << "要把fd:" << (*it).sockfd << "添加到epoll中";
+            if(Epoll_Oper_Event(
+                (*it).sockfd,
+                EPOLL_CTL_ADD,
+                EPOLLIN | EPOLLRDHUP | (edge_triggered_ ? static_cast<uint32_t>(EPOLLET) : 0u),
+                0,
+                p_conn
+                ) == -1)
+            {
+                exit(EXIT_FAILURE);
+            }
+            LOG_INFO << "添加fd:" <<(*it).sockfd << "到epoll中成功";
         }
-        LOG_INFO << "添加fd:" <<(*it).sockfd << "到epoll中成功";
     }
     return 1;
 }
 
 int Socket::Epoll_Oper_Event(int fd, uint32_t event_type, uint32_t flag, int bcaction, Connection *p_conn)
+{
+    lock_guard<mutex> epoll_lock{p_conn->epoll_mutex};
+    return EpollCtlLocked(fd, event_type, flag, bcaction, p_conn);
+}
+
+int Socket::EpollCtlLocked(int fd, uint32_t event_type, uint32_t flag, int bcaction, Connection *p_conn)
 {
     struct epoll_event ev;
     MemZero(&ev, sizeof(ev));
@@ -225,40 +337,78 @@ int Socket::Epoll_Oper_Event(int fd, uint32_t event_type, uint32_t flag, int bca
         return 1;
     }
     ev.data.ptr = static_cast<void*>(p_conn);
-    if(epoll_ctl(epoll_handle_, event_type, fd, &ev) == -1)
+    if(epoll_ctl(p_conn->loop->epoll_handle, event_type, fd, &ev) == -1)
     {
         LOG_ERROR << "epoll_ctl failed";
         return -1;
     }
-    LOG_INFO << fd << "添加到了EPOLL红黑树中";
+    LOG_TRACE << fd << "添加到了EPOLL红黑树中";
     return 1;
 }
 
-// 1:非正常返回，0:正常返回
 void Socket::Epoll_Process_Events()
+{
+    // 其余的反应堆各自一个线程
+    for(size_t i = 1; i < event_loops_.size(); ++i)
+    {
+        EventLoop *loop = event_loops_[i].get();
+        loop->loop_thread = thread(&Socket::RunEventLoop, this, loop);
+    }
+    RunEventLoop(event_loops_[0].get());
+}
+
+// 1:非正常返回，0:正常返回
+void Socket::RunEventLoop(EventLoop *loop)
 {
     int timeout{-1}, events{0};
+    bool timer_empty{true};
     for(;;)
     {
-        if(timer_.Empty())
         {
-            LOG_INFO << "定时器为空";
-            events = epoll_wait(epoll_handle_, events_, MAX_EVENTS, -1);
+            scoped_lock timer_lock{loop->timer_mutex};
+            timer_empty = loop->timer.Empty();
+        }
+        if(timer_empty)
+        {
+            LOG_TRACE << "定时器为空";
+            timeout = -1;
         }
         else
         {
-            LOG_INFO << "定时器不为空:size()" << timer_.Size() << "开始处理定时器事件";
-            timeout = TimerHeartBeatCheck();
-            events = epoll_wait(epoll_handle_, events_, MAX_EVENTS, timeout);
+            LOG_TRACE << "定时器不为空, 开始处理定时器事件";
+            timeout = TimerHeartBeatCheck(loop);
+        }
+        bool has_overload_paused{false};
+        if(overload_enable_)
+        {
+            lock_guard<mutex> paused_lock{loop->overload_paused_mutex};
+            has_overload_paused = !loop->overload_paused.empty();
+        }
+        if((has_overload_paused || overloaded_) && (timeout == -1 || timeout > kOverloadRecheckMilliseconds))
+        {
+            // 过载时或者有连接因为过载暂停了读，没有事件时也要定时检查是否可以恢复
+            // 逻辑线程随时可能放进新的暂停连接，只要还在过载就一直定时检查
+            timeout = kOverloadRecheckMilliseconds;
+        }
+        events = epoll_wait(loop->epoll_handle, loop->events, MAX_EVENTS, timeout);
+        LOG_TRACE << "epoll被激活了:" << events << "个事件";
+        if(has_overload_paused || overloaded_)
+        {
+            // 里面会先更新过载状态
+            ResumeOverloadPaused(loop);
+        }
+        else if(events > 0 && overload_enable_)
+        {
+            // 空闲时过载状态不会更新，处理新事件之前先刷新一次
+            UpdateOverload();
         }
-        LOG_INFO << "epoll被激活了:" << events << "个事件";
         if(events == -1)
         {
-            std::cerr << epoll_handle_ << " " << strerror(errno) << std::endl;
+            std::cerr << loop->epoll_handle << " " << strerror(errno) << std::endl;
             // 被信号打断
             if(errno == EINTR)
             {
-                LOG_INFO << "epoll_wait returned EINTR";
+                LOG_DEBUG << "epoll_wait returned EINTR";
                 continue;
             }
             else
@@ -283,11 +433,11 @@ void Socket::Epoll_Process_Events()
             uint32_t revents{0};
             for(int i{0}; i < events; ++i)
             {
-                p_conn = (Connection*)(events_[i].data.ptr);
-                revents = events_[i].events;
+                p_conn = (Connection*)(loop->events[i].data.ptr);
+                revents = loop->events[i].events;
                 if(revents & EPOLLRDHUP)
                 {
-                    LOG_INFO << "客户端关闭了";
+                    LOG_TRACE << "客户端关闭了";
                 }
                 if(revents &(EPOLLERR | EPOLLHUP))
                 {
@@ -297,12 +447,12 @@ void Socket::Epoll_Process_Events()
                 {
                     // 如果是新连接，则调用的是Socket::EventAccept
                     // 如果是已有连接，则调用的是Socket::ReadRequestHandler
-                    LOG_INFO << "触发了EPOLLIN";
+                    LOG_TRACE << "触发了EPOLLIN";
                     (this->*(p_conn->read_handler))(p_conn);
                 }
                 if(revents & EPOLLOUT)
                 {
-                    LOG_INFO << "触发了EPOLLOUT";
+                    LOG_TRACE << "触发了EPOLLOUT";
                     if(revents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
                     {
                         --p_conn->throw_send_count;
@@ -313,7 +463,18 @@ void Socket::Epoll_Process_Events()
                     }
                 }
             }
-             LOG_INFO << "io事件处理完了，开始下一波";
+            // 本轮收到的包一起投递，每个逻辑线程只入队一次、最多唤醒一次
+            if(!loop->pending_tasks.Empty())
+            {
+                LOG_TRACE << "本轮收到" << loop->pending_tasks.Size() << "个包，交给线程池";
+                g_threadpool.PushBatch(loop->pending_tasks);
+                if(overload_enable_)
+                {
+                    // 一轮读到的包是一起投递的，投递后马上按新的积压更新状态，下一轮就能开始限流
+                    UpdateOverload();
+                }
+            }
+             LOG_TRACE << "io事件处理完了，开始下一波";
         }
        
     }
@@ -322,11 +483,11 @@ void Socket::Epoll_Process_Events()
 
 void Socket::MsgSend(char *p_send_buf)
 {
-    LOG_INFO << "要发送的消息块地址:" << (void*)p_send_buf;
+    LOG_TRACE << "要发送的消息块地址:" << (void*)p_send_buf;
     Memory& memory = Memory::GetInstance();
     
     // 发送消息队列中消息太多了
-    if(send_message_queue_.size() > 50000)
+    if(send_backlog_count_ > overload_max_send_backlog_)
     {
         ++discard_send_pkg_count_;
         memory.FreeMemory(p_send_buf);
@@ -344,14 +505,44 @@ void Socket::MsgSend(char *p_send_buf)
         zd_close_socket_proc(p_conn);
         return;
     }
-    LOG_INFO << "发送的数量还没有超过400";
+    LOG_TRACE << "发送的数量还没有超过400";
     ++p_conn->send_count;
-    LOG_INFO << "此时send_count:" << p_conn->send_count;
-    unique_lock<mutex> send_queue_lock{send_message_queue_mutex_};
-    LOG_INFO << "将内存块添加到了send_message_queue中了";
-    send_message_queue_.push_back(p_send_buf);
-    send_queue_lock.unlock();
-    send_message_queue_cond_.notify_one();
+    ++send_backlog_count_;
+    LOG_TRACE << "此时send_count:" << p_conn->send_count;
+    bool need_schedule{false};
+    {
+        lock_guard<mutex> conn_send_lock{p_conn->send_queue_mutex};
+        p_conn->send_queue.push_back(p_send_buf);
+        // 连接已经在发送流程中的话，由发送流程负责把新数据发出去
+        if(!p_conn->send_scheduled)
+        {
+            p_conn->send_scheduled = true;
+            need_schedule = true;
+        }
+    }
+    LOG_TRACE << "将内存块添加到了连接的发送队列中了";
+    if(need_schedule)
+    {
+        if(direct_send_)
+        {
+            // 连接上没有积压的数据，直接在当前线程发送，
+            // 内核缓冲区满了或者只发出去一部分时，才交给EPOLLOUT驱动
+            SendConnectionQueue(p_conn);
+        }
+        else
+        {
+            ScheduleSend(p_conn);
+        }
+    }
+}
+
+void Socket::ScheduleSend(Connection *p_conn)
+{
+    {
+        lock_guard<mutex> ready_lock{send_ready_mutex_};
+        send_ready_list_.emplace_back(p_conn, p_conn->sequence_num);
+    }
+    send_ready_cond_.notify_one();
 }
 
 void Socket::zd_close_socket_proc(Connection* p_conn)
@@ -359,14 +550,18 @@ void Socket::zd_close_socket_proc(Connection* p_conn)
     // 如果要之前加到了定时器中
     if(ifkickTimeCount)
     {
-        DeleteFromTimerQueue(p_conn->timer_id_);
+        DeleteFromTimerQueue(p_conn);
     }
-    if(p_conn->fd != -1)
     {
-        LOG_INFO << "fd:" << p_conn->fd << "超时了, 要进行关闭了";
-        close(p_conn->fd);
-        LOG_INFO << "关闭成功";
-        p_conn->fd = -1;
+        // 逻辑线程恢复读时会检查fd，关闭和置-1要一起完成
+        lock_guard<mutex> epoll_lock{p_conn->epoll_mutex};
+        if(p_conn->fd != -1)
+        {
+            LOG_DEBUG << "fd:" << p_conn->fd << "超时了, 要进行关闭了";
+            close(p_conn->fd);
+            LOG_DEBUG << "关闭成功";
+            p_conn->fd = -1;
+        }
     }
     if(p_conn->throw_send_count > 0)
     {
@@ -381,7 +576,7 @@ bool Socket::TestFlood(Connection *p_conn)
     if((cur_time-p_conn->flood_kick_last_time) < flood_time_interval_)
     {
         // 发包太频繁了
-        LOG_INFO << "包间隔时间小于100ms";
+        LOG_DEBUG << "包间隔时间小于100ms";
         p_conn->flood_attack_count++;
         p_conn->flood_kick_last_time = cur_time;
     }
@@ -399,145 +594,91 @@ bool Socket::TestFlood(Connection *p_conn)
 
 void Socket::SendQueueThread()
 {
-    int err{0};
-    list<char*>::iterator pos, posend;
-
-    char *p_msg_buf{nullptr};
-    MsgHeader   *p_msg_header{nullptr};
-    PkgHeader   *p_pkg_header{nullptr};
-    Connection  *p_conn{nullptr};
-
-    uint16_t itmp{0};
-    ssize_t send_size{0};
-    Memory& memory = Memory::GetInstance();
+    list<std::pair<Connection*, uint64_t>> ready_list;
 
     // 进程不退出
     while(running_)
     {
-        unique_lock<mutex> message_queue_lock{send_message_queue_mutex_};
-        send_message_queue_cond_.wait(message_queue_lock,[&]{
-            return !send_message_queue_.empty() || !running_;
-        });
-        if(!running_)
-        {
-            break;
-        }
-        LOG_INFO << "send_message_queue.Size()" << send_message_queue_.size();
-        pos = send_message_queue_.begin();
-        posend = send_message_queue_.end();
-        while(pos != posend)
-        {
-            p_msg_buf = *pos;
-            LOG_INFO << "要发送消息的内存块:" << (void*)p_msg_buf;
-            p_msg_header = (MsgHeader*)p_msg_buf;
-            p_pkg_header = (PkgHeader*)(p_msg_buf+msg_header_len_);
-            p_conn = p_msg_header->conn;
-            // 包过期
-            if(p_conn->sequence_num != p_msg_header->cur_sequence_num)
-            {
-                pos = send_message_queue_.erase(pos);
-                memory.FreeMemory(p_msg_buf);
-                continue;
-            }
-            LOG_INFO << "包还没有过期呢";
-            if(p_conn->throw_send_count > 0)
-            {
-                // 靠系统驱动来发送消息，这里不能再发送
-                ++pos;
-                continue;
-            }
-            // 发送队列数减一
-            --p_conn->send_count;
-
-            // 这里可以开始发送消息
-            // 发送后释放用的，因为这段内存是new出来的
-            p_conn->send_mem_pointer = p_msg_buf;
-            pos = send_message_queue_.erase(pos);
-            // 要发送的数据的缓冲区指针
-            p_conn->send_buf = (char*)p_pkg_header;
-            // 包头+包体长度，
-            itmp = ntohs(p_pkg_header->pkg_len);
-            // 要发送多少数据
-            p_conn->send_len = itmp;
-
-            send_size = SendProc(p_conn, p_conn->send_buf, p_conn->send_len);
-            LOG_INFO << "发出去的数据长度:" << send_size;
-            if(send_size > 0)
-            {
-                // 数据全都发送出去了
-                if(send_size == p_conn->send_len)
-                {
-                    LOG_INFO << "数据全都发完了";
-                    memory.FreeMemory(p_conn->send_mem_pointer);
-                    p_conn->send_mem_pointer = nullptr;
-                    p_conn->throw_send_count = 0;
-                }
-                else
-                {
-                    LOG_INFO << "数据只发送了一部分";
-                    // 只发送了部分数据
-                    // 更新发送缓冲区
-                    p_conn->send_buf += send_size;
-                    p_conn->send_len -= send_size;
-                    // 标记发送缓冲区满了
-                    ++p_conn->throw_send_count;
-                    if(Epoll_Oper_Event(
-                        p_conn->fd,
-                        EPOLL_CTL_MOD,
-                        EPOLLOUT,
-                        0,                  // 0增加，1，去掉，2，完全覆盖
-                        p_conn
-                    ) == -1)
-                    {
-                        LOG_ERROR << "Socket::SendQueueThread()->Epoll_Oper_Event() failed";
-                    }
-                }
-                continue;
-            }
-            else if(send_size == 0)
+        {
+            unique_lock<mutex> ready_lock{send_ready_mutex_};
+            send_ready_cond_.wait(ready_lock,[&]{
+                return !send_ready_list_.empty() || !running_;
+            });
+            if(!running_)
             {
-                LOG_INFO << "对端关闭了";
-                // 对端关闭了，
-                // 释放内存
-                memory.FreeMemory(p_conn->send_mem_pointer);
-                p_conn->send_mem_pointer = nullptr;
-                p_conn->throw_send_count = 0;
-                continue;
+                break;
             }
-            else if(send_size == -1)
+            // 一次把所有就绪连接取走，发送的时候不占用锁
+            ready_list.swap(send_ready_list_);
+        }
+        LOG_TRACE << "就绪的连接数:" << ready_list.size();
+        while(!ready_list.empty())
+        {
+            auto [p_conn, sequence_num] = ready_list.front();
+            ready_list.pop_front();
+            if(p_conn->sequence_num != sequence_num)
             {
-                LOG_INFO << "内核缓冲区满了";
-                ++p_conn->throw_send_count;
-                if(Epoll_Oper_Event(
-                        p_conn->fd,
-                        EPOLL_CTL_MOD,
-                        EPOLLOUT,
-                        0,
-                        p_conn
-                    ) == -1)
-                {
-                    LOG_ERROR << "Socket::SendQueueThread()->Epoll_Oper_Event() failed";
-                }
+                // 放入之后连接已经关闭，发送队列由FreeConnection清掉，不能再去发新使用者的数据
+                LOG_DEBUG << "跳过已经失效的就绪连接";
                 continue;
             }
-            else
+            SendConnectionQueue(p_conn);
+        }
+    }
+}
+
+// 调用者必须是当前持有该连接发送权的一方(send_scheduled由它置true)
+// 发送线程和开启了DirectSend的逻辑线程都会调用
+void Socket::SendConnectionQueue(Connection *p_conn)
+{
+    for(;;)
+    {
+        if(!DrainSendQueue(p_conn))
+        {
+            // 内核缓冲区满了，剩下的数据交给epoll驱动，发送权一直保留到WriteRequestHandler发完
+            LOG_TRACE << "数据只发送了一部分或者内核缓冲区满了";
+            // 标记发送缓冲区满了
+            ++p_conn->throw_send_count;
+            if(Epoll_Oper_Event(
+                p_conn->fd,
+                EPOLL_CTL_MOD,
+                EPOLLOUT,
+                0,                  // 0增加，1，去掉，2，完全覆盖
+                p_conn
+            ) == -1)
             {
-                LOG_INFO << "各种尝试都作了，还是不成功，则直接释放内存";
-                memory.FreeMemory(p_conn->send_mem_pointer);
-                p_conn->send_mem_pointer = nullptr;
-                p_conn->throw_send_count = 0;
-                continue;
+                LOG_ERROR << "Socket::SendConnectionQueue()->Epoll_Oper_Event() failed";
             }
+            return;
+        }
+        if(ReleaseSend(p_conn))
+        {
+            return;
         }
     }
 }
 
+void Socket::ClearConnectionSendQueue(Connection *p_conn)
+{
+    Memory& memory = Memory::GetInstance();
+    lock_guard<mutex> conn_send_lock{p_conn->send_queue_mutex};
+    for(char *p_msg_buf : p_conn->send_queue)
+    {
+        memory.FreeMemory(p_msg_buf);
+    }
+    send_backlog_count_ -= p_conn->send_queue.size();
+    p_conn->send_queue.clear();
+    // 就绪队列里可能还有这个连接的旧项，序号已经变了，发送线程会跳过
+    p_conn->send_scheduled = false;
+}
+
 void Socket::Start()
 {
     LOG_INFO << "Socket::Start()开始执行";
     running_ = true;
     send_message_queue_thread_ = thread(&Socket::SendQueueThread, this);
     recycle_connection_thread_ = thread(&Socket::RecycleConnectionThread, this);
+    print_info_thread_ = thread(&Socket::PrintInfoThread, this);
     // if(ifkickTimeCount)
     // {
     //     timer_queue_monitor_thread_ = thread(&Socket::TimerQueueMonitorThread, this);
@@ -549,6 +690,7 @@ void Socket::Start()
 void Socket::Shutdown()
 {
     running_ = false;
+    send_ready_cond_.notify_all();
     if(send_message_queue_thread_.joinable())
     {
         send_message_queue_thread_.join();
@@ -561,4 +703,59 @@ void Socket::Shutdown()
     {
         timer_queue_monitor_thread_.join();
     }
-}
\ No newline at end of file
+    if(print_info_thread_.joinable())
+    {
+        print_info_thread_.join();
+    }
+}
+bool Socket::ConnectionAffinity() const
+{
+    return connection_affinity_;
+}
+
+uint32_t Socket::MaxStreamSize() const
+{
+    return max_stream_size_;
+}
+
+void Socket::PrintInfoThread()
+{
+    last_print_time_ = Timestamp::now();
+    while(running_)
+    {
+        std::this_thread::sleep_for(seconds(1));
+        Timestamp cur_time = Timestamp::now();
+        bool requested = (print_info_requested != 0);
+        if(requested)
+        {
+            print_info_requested = 0;
+        }
+        if(requested || (print_info_interval_.count() > 0 && cur_time >= last_print_time_ + print_info_interval_))
+        {
+            last_print_time_ = cur_time;
+            PrintInfo();
+        }
+    }
+}
+
+void Socket::PrintInfo()
+{
+    size_t recycle_count{0};
+    {
+        lock_guard<mutex> recycle_lock{recycle_connection_pool_mutex_};
+        recycle_count = recycle_connection_pool_.size();
+    }
+    LOG_NOTICE << "------------------------------------begin--------------------------------------";
+    LOG_NOTICE << "当前在线人数/总人数(" << online_user_count_ << "/" << worker_connections_ << ")";
+    LOG_NOTICE << "连接池中空闲连接/总连接/要释放的连接(" << free_connection_n_ << "/" << total_connection_n_ << "/" << recycle_count << ")";
+    LOG_NOTICE << "当前发送队列大小:" << send_backlog_count_ << " 丢弃的待发送数据包数量:" << discard_send_pkg_count_;
+    LOG_NOTICE << "当前线程池中待处理消息数量:" << g_threadpool.WaitingCount();
+    if(overload_enable_)
+    {
+        LOG_NOTICE << "过载状态:" << (overloaded_ ? "过载" : "正常") << " 拒绝的连接数:" << rejected_accept_count_ << " 丢掉的请求数:" << shed_request_count_;
+    }
+#ifdef HAO_MEMORY_STATS
+    Memory::GetInstance().PrintStats();
+#endif
+    LOG_NOTICE << "-------------------------------------end---------------------------------------";
+}
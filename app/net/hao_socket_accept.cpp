@@ -3,11 +3,26 @@
 #include "hao_log.h"
 #include "hao_global.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <mutex>
+
+using std::lock_guard;
+
 using namespace hao_log;
 
 void Socket::EventAccept(Connection *old_connection)
+{
+    // ET模式下要一直accept到EAGAIN，否则剩下的连接要等到下一个新连接到来才会被处理
+    while(AcceptOne(old_connection) && edge_triggered_)
+    {
+
+    }
+}
+
+// 返回false表示没有可以accept的连接了，或者accept出错了
+bool Socket::AcceptOne(Connection *old_connection)
 {
     static int          use_accept4_{1};
     struct sockaddr_in6 client_addr;
@@ -35,7 +50,7 @@ void Socket::EventAccept(Connection *old_connection)
             // accept未准备好
             if(err_code == EAGAIN)
             {
-                return;
+                return false;
             }
             level = LogLevel::ALERT;
             // 对端意外关闭套接字
@@ -59,12 +74,14 @@ void Socket::EventAccept(Connection *old_connection)
             {
                 // 对方关闭套接字
             }
-            if(err_code = EMFILE || err_code == ENFILE)
+            if(err_code == EMFILE || err_code == ENFILE)
             {
-                // FIXME
-                // 使用一个idle_fd来接收
+                // fd用尽时连接一直留在backlog里，ET模式下不会再通知，
+                // 让出预留的idle_fd_把这个连接accept下来直接关掉，再把idle_fd_占回来
+                return AcceptWithIdleFd(old_connection);
             }
-            return;
+            // 对端中途关闭的连接跳过，接着accept下一个
+            return err_code == ECONNABORTED;
             
         }
         // 走到这里，表明accetpt成功了
@@ -72,7 +89,13 @@ void Socket::EventAccept(Connection *old_connection)
         if(online_user_count_ >= worker_connections_)
         {
             close(client_sock_fd);
-            return;
+            return true;
+        }
+        // 服务器过载或者新连接来得太快，直接关掉，不占用连接池
+        if(overload_enable_ && !AdmitConnection())
+        {
+            close(client_sock_fd);
+            return true;
         }
         // FIXME 再想一下这里的进一步判断是否有必要
         // 恶意用户连上来发了1条数据就断开，不断连接，就会导致频繁调用GetConnection使得
@@ -85,7 +108,7 @@ void Socket::EventAccept(Connection *old_connection)
             if(free_connection_pool_.size() < worker_connections_)
             {
                 close(client_sock_fd);
-                return;
+                return true;
             }
         }
         new_conn = GetConnection(client_sock_fd);
@@ -95,45 +118,65 @@ void Socket::EventAccept(Connection *old_connection)
             if(close(client_sock_fd) == -1)
             {
                 LOG_ALERT << "HEpoll::EventAccept() close(" << client_sock_fd << ") failed";
-                return;
+                return true;
             }
         }
         // 成功拿到了连接池中的连接
         new_conn->client_addr.set_sockaddr(client_addr);
-        LOG_INFO << "客户端fd:"<< client_sock_fd << " ip:" << new_conn->client_addr.ToIPPort() << "连接成功";
+        LOG_DEBUG << "客户端fd:"<< client_sock_fd << " ip:" << new_conn->client_addr.ToIPPort() << "连接成功";
         if(!use_accept4_)
         {
             if(SetNonBlocking(client_sock_fd) == false)
             {
                 // 设置非阻塞失败，归还连接
                 CloseConnection(new_conn);
-                return;
+                return true;
             }
         }
         // 设置连接绑定的监听端口
         new_conn->listening_ptr = old_connection->listening_ptr;
+        // 新连接留在accept它的反应堆里
+        new_conn->loop = old_connection->loop;
         new_conn->read_handler = &Socket::ReadRequestHandler;
         new_conn->write_handler = &Socket::WriteRequestHandler;
         if(Epoll_Oper_Event(
                     client_sock_fd,             // 客户端socket
                     EPOLL_CTL_ADD,              // 添加
-                    EPOLLIN | EPOLLRDHUP,        // EPOLLIN可读，EPOLLRDHUP远端关闭
+                    EPOLLIN | EPOLLRDHUP | (edge_triggered_ ? static_cast<uint32_t>(EPOLLET) : 0u),  // EPOLLIN可读，EPOLLRDHUP远端关闭，EPOLLET边缘触发
                     0,                          // 额外参数
                     new_conn                    // 连接池中的连接
                     ) == -1)
         {
             CloseConnection(new_conn);
-            return;
+            return true;
         }
-        LOG_INFO << "要开启踢人功能么:" << ifkickTimeCount;
+        LOG_TRACE << "要开启踢人功能么:" << ifkickTimeCount;
         if(ifkickTimeCount)
         {
-            LOG_INFO << "开始加入timer_queue";
+            LOG_TRACE << "开始加入timer_queue";
             AddToTimerQueue(new_conn);
-            LOG_INFO << "加入timer_queue结束";
+            LOG_TRACE << "加入timer_queue结束";
         }
 
         ++online_user_count_;                   // 在线用户+1
-        break;
+        return true;
     } while (1);
-}
\ No newline at end of file
+}
+
+bool Socket::AcceptWithIdleFd(Connection *old_connection)
+{
+    lock_guard<mutex> idle_lock{idle_fd_mutex_};
+    if(idle_fd_ == -1)
+    {
+        return false;
+    }
+    close(idle_fd_);
+    int client_sock_fd = accept(old_connection->fd, nullptr, nullptr);
+    if(client_sock_fd != -1)
+    {
+        LOG_WARN << "fd用尽，关闭了一个新连接";
+        close(client_sock_fd);
+    }
+    idle_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return client_sock_fd != -1;
+}
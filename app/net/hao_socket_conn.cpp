@@ -32,16 +32,22 @@ void Connection::GetOneToUse()
 {
     ++sequence_num;
     fd = -1;
-    cur_stat = PkgState::Head_Init;
-    precv_buf = head_info;
-    recv_len = sizeof(PkgHeader);
-    // 初始化的时候，还没有new内存
-    precv_mem_pointer = nullptr;
+    // 旧的定时器句柄不能再用
+    timer_id_ = TimerHandle{};
+    // 上一个使用者留下的数据丢掉
+    recv_buffer.RetrieveAll();
     // 发包长度为0
     throw_send_count = 0;
-    // 发送数据头指针记录
-    send_mem_pointer = nullptr;
+    // 还没有进入发送流程
+    send_scheduled = false;
+    send_count = 0;
+    // 还没有正在发送的数据包
+    send_iov_count = 0;
+    send_iov_index = 0;
     events = 0;
+    // 没有在处理中的包
+    in_flight = 0;
+    read_paused = 0;
     last_ping_time = Timestamp::now();
 
     // flood攻击上次收到包的时间
@@ -55,16 +61,20 @@ void Connection::GetOneToUse()
 void Connection::PutOneToFree()
 {
     ++sequence_num;
-    if(precv_mem_pointer != nullptr)
+    // 收了一半的包直接丢弃，缓冲区太大的话缩回去
+    recv_buffer.RetrieveAll();
+    if(recv_buffer.InternalCapacity() > kRecvBufferShrinkSize)
     {
-        Memory::GetInstance().FreeMemory(precv_mem_pointer);
-        precv_mem_pointer = nullptr;
+        recv_buffer.Shrink(0);
     }
-    if(send_mem_pointer != nullptr)
+    // 释放发了一半的那批数据包
+    for(int i = send_iov_index; i < send_iov_count; ++i)
     {
-        Memory::GetInstance().FreeMemory(send_mem_pointer);
-        send_mem_pointer = nullptr;
+        Memory::GetInstance().FreeMemory(send_batch[i]);
+        send_batch[i] = nullptr;
     }
+    send_iov_count = 0;
+    send_iov_index = 0;
     throw_send_count = 0;
 }
 
@@ -111,7 +121,6 @@ Connection* Socket::GetConnection(int sock_fd)
         p_conn->GetOneToUse();
         --free_connection_n_;
         p_conn->fd = sock_fd;
-        LOG_INFO << "从连接池中取一个连接时recv_len:" << p_conn->recv_len;
         return p_conn;
     }
     // 如果没空闲连接，则重新新建一个
@@ -127,6 +136,8 @@ Connection* Socket::GetConnection(int sock_fd)
 
 void Socket::FreeConnection(Connection* p_conn)
 {
+    // 连接上还没发出去的数据直接丢弃
+    ClearConnectionSendQueue(p_conn);
     lock_guard<mutex> lock(connection_pool_mutex_);
     p_conn->PutOneToFree();
     free_connection_pool_.push(p_conn);
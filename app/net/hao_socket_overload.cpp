@@ -0,0 +1,136 @@
+#include "hao_socket.h"
+#include "hao_log.h"
+#include "hao_common.h"
+#include "hao_memory.h"
+#include "hao_global.h"
+#include "hao_logic_common.h"
+
+#include <arpa/inet.h>
+
+#include <mutex>
+
+using std::lock_guard;
+
+using namespace hao_log;
+
+// 进入和退出用不同的阈值，避免在阈值附近来回切换
+void Socket::UpdateOverload()
+{
+    size_t waiting = overload_max_waiting_ > 0 ? g_threadpool.WaitingCount() : 0;
+    int backlog = send_backlog_count_;
+    if(!overloaded_)
+    {
+        bool over = (overload_max_waiting_ > 0 && waiting >= overload_max_waiting_)
+                    || backlog >= overload_max_send_backlog_;
+        bool expected{false};
+        if(over && overloaded_.compare_exchange_strong(expected, true))
+        {
+            LOG_WARN << "服务器过载，线程池积压:" << waiting << " 发送队列积压:" << backlog;
+        }
+        return;
+    }
+    bool recovered = (overload_max_waiting_ == 0 || waiting * 100 < overload_max_waiting_ * overload_recover_percent_)
+                    && static_cast<int64_t>(backlog) * 100 < static_cast<int64_t>(overload_max_send_backlog_) * overload_recover_percent_;
+    bool expected{true};
+    if(recovered && overloaded_.compare_exchange_strong(expected, false))
+    {
+        LOG_WARN << "服务器退出过载状态，线程池积压:" << waiting << " 发送队列积压:" << backlog;
+    }
+}
+
+bool Socket::AdmitConnection()
+{
+    if(overloaded_)
+    {
+        ++rejected_accept_count_;
+        return false;
+    }
+    if(overload_max_accept_rate_ == 0)
+    {
+        return true;
+    }
+    // 按秒统计，多个反应堆共用，只要求大致准确
+    int64_t second = Timestamp::now().Microseconds() / Timestamp::kMicroSecondsPerSecond;
+    int64_t window = accept_second_;
+    if(window != second && accept_second_.compare_exchange_strong(window, second))
+    {
+        accept_count_ = 0;
+    }
+    if(++accept_count_ > overload_max_accept_rate_)
+    {
+        ++rejected_accept_count_;
+        return false;
+    }
+    return true;
+}
+
+bool Socket::AdmitRequest(Connection* p_conn, const char* pkg)
+{
+    if(!overloaded_)
+    {
+        return true;
+    }
+    // 心跳包不丢，否则过载时连接会因为心跳超时被成批踢掉
+    const PkgHeader* header = reinterpret_cast<const PkgHeader*>(pkg);
+    if(ntohs(header->msg_code) == CMD_PING)
+    {
+        return true;
+    }
+    switch(overload_policy_)
+    {
+    case OverloadPolicy::Pause:
+        // 这个包照常处理，之后不再从这个连接读，已经因为在处理中的包太多暂停了的也要记下来
+        if(PauseRead(p_conn, kPauseOverload))
+        {
+            DeferOverloadResume(p_conn);
+        }
+        return true;
+    case OverloadPolicy::Busy:
+        SendBusy(p_conn);
+        break;
+    case OverloadPolicy::Drop:
+        break;
+    }
+    ++shed_request_count_;
+    return false;
+}
+
+void Socket::SendBusy(Connection* p_conn)
+{
+    Memory& memory = Memory::GetInstance();
+    char *p_send_buf = (char*)memory.AllocMemory(msg_header_len_ + pkg_header_len_, false);
+    MsgHeader* p_msg_header = (MsgHeader*)p_send_buf;
+    p_msg_header->conn = p_conn;
+    p_msg_header->cur_sequence_num = p_conn->sequence_num;
+    PkgHeader* p_pkg_header = (PkgHeader*)(p_send_buf + msg_header_len_);
+    p_pkg_header->pkg_len = htons(pkg_header_len_);
+    p_pkg_header->msg_code = htons(CMD_BUSY);
+    // 只有包头的包crc给0
+    p_pkg_header->crc32 = 0;
+    MsgSend(p_send_buf);
+}
+
+void Socket::DeferOverloadResume(Connection* p_conn)
+{
+    lock_guard<mutex> paused_lock{p_conn->loop->overload_paused_mutex};
+    p_conn->loop->overload_paused.emplace_back(p_conn, p_conn->sequence_num);
+}
+
+void Socket::ResumeOverloadPaused(EventLoop* loop)
+{
+    UpdateOverload();
+    if(overloaded_)
+    {
+        return;
+    }
+    vector<std::pair<Connection*, uint64_t>> paused;
+    {
+        lock_guard<mutex> paused_lock{loop->overload_paused_mutex};
+        paused.swap(loop->overload_paused);
+    }
+    for(auto& [p_conn, sequence_num] : paused)
+    {
+        // 连接已经关闭或者复用了的，ResumeRead里会跳过，又过载了的会重新放回来
+        ResumeRead(p_conn, sequence_num, kPauseOverload);
+    }
+}
@@ -4,134 +4,78 @@
 #include "hao_memory.h"
 #include "hao_global.h"
 #include "hao_logic.h"
+#include "hao_algorithm.h"
 
 #include <string.h>
 
+#include <mutex>
+using std::lock_guard;
+
 using namespace hao_log;
 
 void Socket::ReadRequestHandler(Connection* conn)
 {
-    LOG_INFO << "进了ReadRequestHandler";
+    LOG_TRACE << "进了ReadRequestHandler";
     bool is_flood {false};
-    ssize_t reco = RecvProc(conn, conn->precv_buf, conn->recv_len);
-    // 客户端关闭或出现其他问题
-    if(reco <= 0)
-    {
-        return;
-    }
-    // 有数据了
-    if(conn->cur_stat == PkgState::Head_Init)
-    {
-        LOG_INFO << "当前状态:Head_Init";
-        // 如果收到了完整的包头
-        if(reco == pkg_header_len_)
-        {
-            LOG_INFO << "收到了完整的包头";
-            WaitRequestHandlerProcP1(conn, is_flood);
-        }
-        else
-        {
-            LOG_INFO << "收到的头不完整，要接着收";
-            // 收到的包头不完整，内存和要收的数量要即时调整
-            conn->cur_stat = PkgState::Haed_Recving;
-            conn->precv_buf = conn->precv_buf + reco;
-            conn->recv_len = conn->recv_len - reco;
-        }
-    }
-    else if(conn->cur_stat == PkgState::Haed_Recving)
-    {
-        LOG_INFO << "当前状态:Head_Recving";
-        if(conn->recv_len == reco)
-        {
-            // 包头收完整了
-            LOG_INFO << "第二个elseif中收到了完整的包头";
-            WaitRequestHandlerProcP1(conn, is_flood);
-        }
-        else
-        {
-            LOG_INFO << "接着收包头";
-            conn->precv_buf = conn->precv_buf + reco;
-            conn->recv_len = conn->recv_len - reco;
-        }
-    }
-    else if(conn->cur_stat == PkgState::Body_Init)
+    // LT模式只收一次，ET模式要一直收到EAGAIN为止，否则剩下的数据不会再有通知
+    for(;;)
     {
-        LOG_INFO << "当前状态:Body_Init";
-        // 包头刚好收完，开始收包体
-        if(reco == conn->recv_len)
+        ssize_t reco = RecvProc(conn);
+        // 客户端关闭、出现其他问题或ET模式下数据收完了
+        if(reco <= 0)
         {
-            // 收到完整的包体了
-            LOG_INFO << "正好收到了完整的包体";
-            if(flood_ak_enable_)
-            {
-                is_flood = TestFlood(conn);
-            }
-            WaitRequestHandlerProcPlast(conn, is_flood);
-        }
-        else
-        {
-            conn->cur_stat = PkgState::Body_Recving;
-            conn->precv_buf = conn->precv_buf + reco;
-            conn->recv_len = conn->recv_len - reco;
+            return;
         }
-    }
-    else if(conn->cur_stat == PkgState::Body_Recving)
-    {
-        LOG_INFO << "当前状态:Body_Recving";
-        if(conn->recv_len == reco)
+        // 一次读到的数据里可能有多个完整的包，全部切出来处理
+        WaitRequestHandlerProcP1(conn, is_flood);
+        if(is_flood == true)
         {
-            // 包体收完整了
-            if(flood_ak_enable_)
-            {
-                is_flood = TestFlood(conn);
-            }
-            WaitRequestHandlerProcPlast(conn, is_flood);
+            // 客户端flood，则直接关闭客户端
+            zd_close_socket_proc(conn);
+            return;
         }
-        else
+        // 在处理中的包太多，暂停读了，剩下的数据留在内核缓冲区里
+        if(!edge_triggered_ || conn->read_paused)
         {
-            conn->precv_buf = conn->precv_buf + reco;
-            conn->recv_len = conn->recv_len - reco;
+            break;
         }
     }
-    LOG_INFO << "收完了";
-    if(is_flood == true)
-    {
-        // 客户端flood，则直接关闭客户端
-        zd_close_socket_proc(conn);
-    }
-
+    LOG_TRACE << "收完了";
 }
 
-ssize_t Socket::RecvProc(Connection* conn,  char *buf, ssize_t buf_len)
+ssize_t Socket::RecvProc(Connection* conn)
 {
-    LOG_INFO << "准备收数据了,要收的数据长度为:" << buf_len;
-    ssize_t n{0};
-    // 参数为0的时候，基本等同于read
-    n = recv(conn->fd, buf, buf_len, 0);
-    LOG_INFO << "收到的数据长度:" << n;
+    LOG_TRACE << "准备收数据了,缓冲区中已有的数据长度为:" << conn->recv_buffer.ReadableBytes();
+    int saved_errno{0};
+    // 用readv一次尽量多读，缓冲区不够的部分先读到栈上再追加进来
+    ssize_t n = conn->recv_buffer.ReadFd(conn->fd, &saved_errno);
+    LOG_TRACE << "收到的数据长度:" << n;
     if(n == 0)
     {
         // 客户端关闭
-        LOG_INFO << "客户端关闭了连接";
+        LOG_DEBUG << "客户端关闭了连接";
         zd_close_socket_proc(conn);
         return 0;
     }
     if(n < 0)
     {
-        // 没有收到数据，LT模式一般不会出现这个错误
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        // 没有收到数据，LT模式一般不会出现这个错误，ET模式下表示数据收完了
+        if(saved_errno == EAGAIN || saved_errno == EWOULDBLOCK)
         {
-            LOG_ERROR << "RecvProc中errno == EAGAIN || errno == EWOULDBLOCK成立";
+            if(!edge_triggered_)
+            {
+                LOG_ERROR << "RecvProc中errno == EAGAIN || errno == EWOULDBLOCK成立";
+            }
             return -1;
         }
         // 被信号打断了，直接返回
-        if(errno == EINTR)
+        if(saved_errno == EINTR)
         {
-            LOG_INFO << "RecvProc中errno == EINTR成立";
+            LOG_DEBUG << "RecvProc中errno == EINTR成立";
             return -1;
         }
         // 下面的错误都属于异常了，意味着要关闭客户端套接字到连接池中
-        if(errno == ECONNRESET)
+        if(saved_errno == ECONNRESET)
         {
             // 客户端没有4次挥手直接关闭了程序，则会给服务器发rst包
             // FIXME
@@ -139,7 +83,7 @@ ssize_t Socket::RecvProc(Connection* conn,  char *buf, ssize_t buf_len)
         }
         else
         {
-            if(errno == EBADF)
+            if(saved_errno == EBADF)
             {
                 // FIXME
 
@@ -155,89 +99,187 @@ ssize_t Socket::RecvProc(Connection* conn,  char *buf, ssize_t buf_len)
 }
 
 void Socket::WaitRequestHandlerProcP1(Connection* p_conn, bool& is_flood)
+{
+    hao_util::Buffer& buffer = p_conn->recv_buffer;
+    // 缓冲区里至少要有一个包头才能判断包长
+    while(buffer.ReadableBytes() >= static_cast<size_t>(pkg_header_len_))
+    {
+        const PkgHeader* header = reinterpret_cast<const PkgHeader*>(buffer.Peek());
+        uint16_t pkg_len = ntohs(header->pkg_len);
+        LOG_TRACE << "包长度:" << pkg_len;
+        // 恶意包或错包的判断
+        if(pkg_len < pkg_header_len_ || pkg_len > (PKG_MAX_LENGTH - pkg_header_len_))
+        {
+            // 丢掉这个包头，从后面的数据重新开始解析
+            buffer.Retrieve(pkg_header_len_);
+            continue;
+        }
+        // 包还没收完整，等下次数据来了再切
+        if(buffer.ReadableBytes() < pkg_len)
+        {
+            break;
+        }
+        if(flood_ak_enable_ && !IsStreamContinuation(buffer.Peek(), pkg_len))
+        {
+            is_flood = TestFlood(p_conn);
+        }
+        if(is_flood == true)
+        {
+            return;
+        }
+        if(!overload_enable_ || AdmitRequest(p_conn, buffer.Peek()))
+        {
+            WaitRequestHandlerProcPlast(p_conn, buffer.Peek(), pkg_len);
+        }
+        buffer.Retrieve(pkg_len);
+    }
+    // 数据全部处理完时，把读到大包后撑大的缓冲区缩回去，避免空闲连接长期占着大块内存
+    if(buffer.ReadableBytes() == 0 && buffer.InternalCapacity() > kRecvBufferShrinkSize)
+    {
+        buffer.Shrink(0);
+    }
+}
+
+// 数据流除第一片以外的分片，一个数据流只按一个包算flood，否则大一点的上传就会被踢掉
+bool Socket::IsStreamContinuation(const char* pkg, uint16_t pkg_len) const
+{
+    const PkgHeader* header = reinterpret_cast<const PkgHeader*>(pkg);
+    if(max_stream_size_ == 0 || !(ntohs(header->msg_code) & kStreamFlag)
+        || pkg_len < pkg_header_len_ + kStreamHeaderSize)
+    {
+        return false;
+    }
+    const StreamHeader* stream_header = reinterpret_cast<const StreamHeader*>(pkg + pkg_header_len_);
+    return stream_header->offset != 0;
+}
+
+void Socket::WaitRequestHandlerProcPlast(Connection* p_conn, const char *pkg, uint16_t pkg_len)
 {
     Memory& memory = Memory::GetInstance();
+    // 合法的包
+    // 分配的内存大小为:消息头+包总大小(包头+包体)
+    LOG_TRACE << "要申请的大小:msg_header_len" << msg_header_len_ << " pkg_len:" << pkg_len;
+    char *p_temp_buffer = (char*)memory.AllocMemory(msg_header_len_ + pkg_len, false);
+
+    // 写消息头部
+    MsgHeader* p_temp_msg_header = (MsgHeader*)p_temp_buffer;
+    p_temp_msg_header->conn = p_conn;
+    p_temp_msg_header->cur_sequence_num = p_conn->sequence_num;
+
+    // 把包头+包体拷贝过来
+    memcpy(p_temp_buffer + msg_header_len_, pkg, pkg_len);
+    // 先攒在反应堆的批次里，本轮事件处理完后在RunEventLoop中一起交给线程池
+    LOG_TRACE << "收到的包放入本轮的批次中";
+    const PkgHeader* header = reinterpret_cast<const PkgHeader*>(pkg);
+    if(connection_affinity_ || (ntohs(header->msg_code) & kStreamFlag))
+    {
+        // 按连接id固定到一个逻辑线程，同一个连接的包按收到的顺序处理
+        // 数据流的分片必须按顺序交给处理函数，不管是否开启了ConnectionAffinity都要固定
+        p_conn->loop->pending_tasks.AddTo(p_conn->Id(), &LogicSocket::HandleMessage, &g_logic_socket, p_temp_buffer);
+    }
+    else
+    {
+        p_conn->loop->pending_tasks.Add(&LogicSocket::HandleMessage, &g_logic_socket, p_temp_buffer);
+    }
+    // 已经读到缓冲区里的包还会继续切出来，上限只是不再从套接字读
+    if(max_in_flight_ > 0 && ++p_conn->in_flight >= max_in_flight_ && !(p_conn->read_paused & kPauseInFlight))
+    {
+        PauseRead(p_conn, kPauseInFlight);
+    }
+}
 
-    PkgHeader* header = (PkgHeader*)p_conn->head_info;
-    uint16_t pkg_len = ntohs(header->pkg_len);
-    LOG_INFO << "包长度:" << pkg_len;
-    // 恶意包或错包的判断
-    if(pkg_len < pkg_header_len_ || pkg_len > (PKG_MAX_LENGTH - pkg_header_len_))
+bool Socket::PauseRead(Connection* p_conn, uint8_t reason)
+{
+    lock_guard<mutex> epoll_lock{p_conn->epoll_mutex};
+    if((p_conn->read_paused & reason) || p_conn->fd == -1)
     {
-        p_conn->cur_stat = PkgState::Head_Init;
-        p_conn->precv_buf =  p_conn->head_info;
-        p_conn->recv_len = pkg_header_len_;
+        return false;
+    }
+    if(reason == kPauseOverload)
+    {
+        LOG_DEBUG << "服务器过载，暂停读连接" << p_conn->client_addr.ToIPPort();
     }
     else
     {
-        LOG_INFO << "这是一个合法的包头";
-        // 合法的包头
-        // 分配的内存大小为:消息头+包总大小(包头+包体)
-        LOG_INFO << "要申请的大小:msg_header_len" << msg_header_len_ << " pkg_len:" << pkg_len;
-        char *p_temp_buffer = (char*)memory.AllocMemory(msg_header_len_ + pkg_len, false);
-        LOG_INFO << "申请到的内存地址为:" << (void*)p_temp_buffer;
-        p_conn->precv_mem_pointer = p_temp_buffer;
+        LOG_DEBUG << "连接" << p_conn->client_addr.ToIPPort() << "在处理中的包达到" << max_in_flight_ << "个，暂停读";
+    }
+    // 已经因为别的原因暂停了的，只记下原因
+    if(p_conn->read_paused.fetch_or(reason) == 0)
+    {
+        EpollCtlLocked(p_conn->fd, EPOLL_CTL_MOD, EPOLLIN, 1, p_conn);
+    }
+    // 逻辑线程减计数时看到的可能还是没有暂停，这里再检查一次，避免没人来恢复
+    if(reason == kPauseInFlight && p_conn->in_flight <= max_in_flight_ / 2)
+    {
+        ClearPauseLocked(p_conn, kPauseInFlight);
+    }
+    return true;
+}
 
-        // 写消息头部
-        MsgHeader* p_temp_msg_header = (MsgHeader*)p_temp_buffer;
-        p_temp_msg_header->conn = p_conn;
-        p_temp_msg_header->cur_sequence_num = p_conn->sequence_num;
+void Socket::ResumeRead(Connection* p_conn, uint64_t sequence_num, uint8_t reason)
+{
+    lock_guard<mutex> epoll_lock{p_conn->epoll_mutex};
+    // 连接已经关闭或者被复用了
+    if(!(p_conn->read_paused & reason) || p_conn->fd == -1 || p_conn->sequence_num != sequence_num)
+    {
+        return;
+    }
+    if(reason == kPauseInFlight && p_conn->in_flight > max_in_flight_ / 2)
+    {
+        return;
+    }
+    ClearPauseLocked(p_conn, reason);
+}
 
-        // 写包头内容
-        p_temp_buffer += msg_header_len_;
-        // 把收到的包头拷贝过来
-        memcpy(p_temp_buffer, header, pkg_header_len_);
-        if(pkg_len ==  pkg_header_len_)
-        {
-            // 只有包头的报文
-            if(flood_ak_enable_)
-            {
-                is_flood = TestFlood(p_conn);
-            }
-            // 处理该条消息
-            WaitRequestHandlerProcPlast(p_conn, is_flood);
-        }
-        else
-        {
-            LOG_INFO << "开始收包体";
-            // 开始收包体
-            p_conn->cur_stat = PkgState::Body_Init;
-            p_conn->precv_buf = p_temp_buffer + pkg_header_len_;
-            p_conn->recv_len = pkg_len - pkg_header_len_;
-        }
+void Socket::ClearPauseLocked(Connection* p_conn, uint8_t reason)
+{
+    if((p_conn->read_paused &= static_cast<uint8_t>(~reason)) != 0)
+    {
+        // 还有别的暂停原因
+        return;
+    }
+    if(overload_policy_ == OverloadPolicy::Pause && overloaded_)
+    {
+        // 还在过载，改成因为过载暂停，等反应堆在退出过载状态后恢复
+        p_conn->read_paused = kPauseOverload;
+        DeferOverloadResume(p_conn);
+        return;
     }
+    LOG_DEBUG << "连接" << p_conn->client_addr.ToIPPort() << "恢复读";
+    // 先清标志再加EPOLLIN：加上后反应堆马上就可能收到通知，
+    // 边缘触发时它看到read_paused不为0的话会不读到EAGAIN就返回，之后不会再有通知
+    EpollCtlLocked(p_conn->fd, EPOLL_CTL_MOD, EPOLLIN, 0, p_conn);
 }
 
-void Socket::WaitRequestHandlerProcPlast(Connection* p_conn, bool &is_flood)
+void Socket::RequestDone(Connection* p_conn, uint64_t sequence_num)
 {
-    if(is_flood == false)
+    if(max_in_flight_ == 0)
     {
-        LOG_INFO << "is_flood:" << is_flood;
-        LOG_INFO << "要把p_conn中的内存块发送到线程池中了";
-        g_threadpool.PushTask(&LogicSocket::HandleMessage, &g_logic_socket, p_conn->precv_mem_pointer);
+        return;
     }
-    else
+    // 连接被复用后计数已经清零了，旧连接的包不能再减
+    if(p_conn->sequence_num != sequence_num)
+    {
+        return;
+    }
+    // 留一半的余量再恢复，避免在上限附近反复修改epoll
+    if(--p_conn->in_flight <= max_in_flight_ / 2 && (p_conn->read_paused & kPauseInFlight))
     {
-        // FIXME 这里是flood攻击，是否需要主动关闭socket
-        // FIXED,flood攻击的时候，直接把fd关闭了
-        LOG_INFO << "检测到了flood攻击, 要关闭该连接了" << p_conn->client_addr.ToIPPort();
-        Memory& memory = Memory::GetInstance();
-        memory.FreeMemory(p_conn->precv_mem_pointer);
-        zd_close_socket_proc(p_conn);   
-        LOG_INFO << "连接关闭成功";
+        ResumeRead(p_conn, sequence_num, kPauseInFlight);
     }
-    p_conn->precv_mem_pointer = nullptr;
-    p_conn->cur_stat = PkgState::Head_Init;
-    p_conn->precv_buf = p_conn->head_info;
-    p_conn->recv_len = pkg_header_len_;
 }
 
-ssize_t Socket::SendProc(Connection* p_conn, char* buff, ssize_t size)
+ssize_t Socket::SendProc(Connection* p_conn, struct iovec *iov, int iov_count)
 {
     ssize_t n{0};
+    struct msghdr msg;
+    MemZero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
     for(;;)
     {
-        n = send(p_conn->fd, buff, size, 0);
+        // MSG_NOSIGNAL:对端已关闭时返回EPIPE，而不是让进程收到SIGPIPE
+        n = sendmsg(p_conn->fd, &msg, MSG_NOSIGNAL);
         if(n > 0)
         {
             return n;
@@ -245,7 +287,7 @@ ssize_t Socket::SendProc(Connection* p_conn, char* buff, ssize_t size)
         if(n == 0)
         {
             // send 0表示对端关闭了连接
-            LOG_INFO << "对段关闭了!!!";
+            LOG_DEBUG << "对段关闭了!!!";
             return 0;
         }
         if(errno == EAGAIN)
@@ -256,7 +298,7 @@ ssize_t Socket::SendProc(Connection* p_conn, char* buff, ssize_t size)
         if(errno == EINTR)
         {
             // 被信号打断了
-            LOG_INFO << "Socket::SendProc()->send() failed";
+            LOG_INFO << "Socket::SendProc()->sendmsg() failed";
         }
         else
         {
@@ -265,38 +307,138 @@ ssize_t Socket::SendProc(Connection* p_conn, char* buff, ssize_t size)
     }
 }
 
-void Socket::WriteRequestHandler(Connection* p_conn)
+int Socket::FillSendBatch(Connection* p_conn)
 {
     Memory& memory = Memory::GetInstance();
+    int count{0};
+    char *p_msg_buf{nullptr};
+    PkgHeader *p_pkg_header{nullptr};
 
-    ssize_t send_size = SendProc(p_conn, p_conn->send_buf, p_conn->send_len);
-    if(send_size > 0 && send_size != p_conn->send_len)
+    lock_guard<mutex> conn_send_lock{p_conn->send_queue_mutex};
+    while(count < MAX_SEND_IOV && !p_conn->send_queue.empty())
     {
-        // 没有全发完
-        p_conn->send_buf += send_size;
-        p_conn->send_len -= send_size;
-        return;
+        p_msg_buf = p_conn->send_queue.front();
+        p_conn->send_queue.pop_front();
+        --send_backlog_count_;
+        // 发送队列数减一
+        --p_conn->send_count;
+        // 包过期
+        if(p_conn->sequence_num != ((MsgHeader*)p_msg_buf)->cur_sequence_num)
+        {
+            memory.FreeMemory(p_msg_buf);
+            continue;
+        }
+        p_pkg_header = (PkgHeader*)(p_msg_buf + msg_header_len_);
+        p_conn->send_batch[count] = p_msg_buf;
+        p_conn->send_iov[count].iov_base = p_pkg_header;
+        // 包头+包体长度
+        p_conn->send_iov[count].iov_len = ntohs(p_pkg_header->pkg_len);
+        ++count;
     }
-    else if(send_size == -1)
+    p_conn->send_iov_count = count;
+    p_conn->send_iov_index = 0;
+    return count;
+}
+
+void Socket::DropSendBatch(Connection* p_conn)
+{
+    Memory& memory = Memory::GetInstance();
+    for(int i = p_conn->send_iov_index; i < p_conn->send_iov_count; ++i)
     {
-        LOG_ERROR << "Socket::WriteRequestHandler()->send_size == -1";
-        return;
+        memory.FreeMemory(p_conn->send_batch[i]);
+        p_conn->send_batch[i] = nullptr;
     }
-    if(send_size > 0 && send_size == p_conn->send_len)
+    p_conn->send_iov_count = 0;
+    p_conn->send_iov_index = 0;
+}
+
+bool Socket::DrainSendQueue(Connection* p_conn)
+{
+    Memory& memory = Memory::GetInstance();
+    for(;;)
     {
-        // 数据全发完了，则移除可写事件
-        if(Epoll_Oper_Event(
-                p_conn->fd,
-                EPOLL_CTL_MOD,
-                EPOLLOUT,
-                1,              // 0:增加，1:去掉，2:完全覆盖
-                p_conn
-            ) == -1)
+        if(p_conn->send_iov_index == p_conn->send_iov_count && FillSendBatch(p_conn) == 0)
+        {
+            // 队列里没有数据了
+            return true;
+        }
+        ssize_t send_size = SendProc(p_conn, 
+                                     &p_conn->send_iov[p_conn->send_iov_index], 
+                                     p_conn->send_iov_count - p_conn->send_iov_index);
+        LOG_TRACE << "发出去的数据长度:" << send_size;
+        if(send_size == -1)
+        {
+            // 内核缓冲区满了
+            return false;
+        }
+        if(send_size <= 0)
+        {
+            // 对端关闭了，或者各种尝试都作了，还是不成功，则直接释放内存
+            LOG_DEBUG << "发送失败，直接释放内存";
+            DropSendBatch(p_conn);
+            continue;
+        }
+        // 释放已经完整发出去的数据包，调整发了一半的数据包
+        size_t left = static_cast<size_t>(send_size);
+        while(left > 0)
+        {
+            struct iovec& iov = p_conn->send_iov[p_conn->send_iov_index];
+            if(left >= iov.iov_len)
+            {
+                left -= iov.iov_len;
+                memory.FreeMemory(p_conn->send_batch[p_conn->send_iov_index]);
+                p_conn->send_batch[p_conn->send_iov_index] = nullptr;
+                ++p_conn->send_iov_index;
+            }
+            else
+            {
+                iov.iov_base = static_cast<char*>(iov.iov_base) + left;
+                iov.iov_len -= left;
+                left = 0;
+            }
+        }
+        if(p_conn->send_iov_index != p_conn->send_iov_count)
         {
-            LOG_ERROR << "Socket::WriteRequestHandler()->Epoll_Oper_Event() failed";
+            // 只发出去一部分，说明内核缓冲区满了
+            return false;
         }
     }
-    memory.FreeMemory(p_conn->send_mem_pointer);
-    p_conn->send_mem_pointer = nullptr;
+}
+
+bool Socket::ReleaseSend(Connection* p_conn)
+{
+    lock_guard<mutex> conn_send_lock{p_conn->send_queue_mutex};
+    if(p_conn->send_queue.empty())
+    {
+        p_conn->send_scheduled = false;
+        return true;
+    }
+    return false;
+}
+
+void Socket::WriteRequestHandler(Connection* p_conn)
+{
+    if(!DrainSendQueue(p_conn))
+    {
+        // 还没发完，等下一次EPOLLOUT
+        return;
+    }
+    // 数据全发完了，则移除可写事件
+    if(Epoll_Oper_Event(
+            p_conn->fd,
+            EPOLL_CTL_MOD,
+            EPOLLOUT,
+            1,              // 0:增加，1:去掉，2:完全覆盖
+            p_conn
+        ) == -1)
+    {
+        LOG_ERROR << "Socket::WriteRequestHandler()->Epoll_Oper_Event() failed";
+    }
     --p_conn->throw_send_count;
-}
\ No newline at end of file
+
+    // 先去掉EPOLLOUT再交还发送权，队列里又有数据的话交回发送线程
+    if(!ReleaseSend(p_conn))
+    {
+        ScheduleSend(p_conn);
+    }
+}
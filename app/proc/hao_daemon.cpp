@@ -58,7 +58,9 @@ int hao_server::MakeDaemon()
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     if(sigaction(SIGHUP, &sa, NULL) < 0)
+    {
         LOG_ERROR << "Can't ignore SIGHUP";
+    }
         // 输出错误信息 can't ignore SIGHUP 
     switch(fork())
     {
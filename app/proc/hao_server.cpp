@@ -43,6 +43,7 @@ ProcessType process_type;
 
 // 子进程状态是否发生改变
 sig_atomic_t worker_status_changed;
+sig_atomic_t print_info_requested;
 
 // 是否以守护进程运行
 int daemonized{0};
@@ -211,7 +212,15 @@ void hao_server::ServerInit(int argc, char *argv[])
     {
         cerr << "注册服务器退出函数失败" << endl;
     }
-    LOG_INIT(static_cast<string_view>(config["Log"]["Path"]),(LogLevel)((int)config["Log"]["Level"]));
+    // 老的配置文件没有AsyncBufferSize，读出来是0，用默认大小
+    int async_buffer_kb = static_cast<int>(config["Log"]["AsyncBufferSize"]);
+    LOG_INIT(static_cast<string_view>(config["Log"]["Path"]),(LogLevel)((int)config["Log"]["Level"]),
+                static_cast<bool>(config["Log"]["Async"]),
+                async_buffer_kb > 0 ? static_cast<size_t>(async_buffer_kb) * 1024 : kDefaultAsyncBufferSize);
+    LOG_USE_COARSE_CLOCK(static_cast<bool>(config["Log"]["CoarseClock"]));
+    LOG_USE_BINARY(static_cast<bool>(config["Log"]["Binary"]));
+    LOG_SET_ROTATION(static_cast<size_t>(static_cast<int>(config["Log"]["RotateSize"])) * 1024 * 1024,
+                        static_cast<int>(config["Log"]["RotateInterval"]));
     // 设置进程全局变量
     g_stop_event = 0;
     process_type = ProcessType::Master;
@@ -34,6 +34,8 @@ vector<Signal> signals{
     { SIGCHLD,   "SIGCHLD",          signal_handler },        //子进程退出时，父进程会收到这个信号--标识17
     { SIGQUIT,   "SIGQUIT",          signal_handler },        //标识3
     { SIGIO,     "SIGIO",            signal_handler },        //指示一个异步I/O事件【通用异步I/O信号】
+    { SIGUSR1,   "SIGUSR1",          signal_handler },        //重新打开日志文件，外部改名日志文件后发送给进程组
+    { SIGUSR2,   "SIGUSR2",          signal_handler },        //worker进程收到后打印一次统计信息
     { SIGSYS,    "SIGSYS, SIG_IGN",  nullptr             },        //我们想忽略这个信号，SIGSYS表示收到了一个无效系统调用，如果我们不忽略，进程会被操作系统杀死，--标识31
                                                                    //所以我们把handler设置为NULL，代表 我要求忽略这个信号，请求操作系统不要执行缺省的该信号处理动作（杀掉我）
     //...日后根据需要再继续增加
@@ -89,6 +91,10 @@ static void signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
             // 子进程状态变化了。
             worker_status_changed = 1;
             break;
+        case SIGUSR1:
+            // 重新打开日志文件
+            LOG_REQUEST_REOPEN();
+            break;
         
         default:
             break;
@@ -97,6 +103,20 @@ static void signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
     else if(process_type == ProcessType::Worker)
     {
         // 子进程信号处理
+        switch (signo)
+        {
+        case SIGUSR2:
+            // 让统计线程打印一次统计信息
+            print_info_requested = 1;
+            break;
+        case SIGUSR1:
+            // 重新打开日志文件
+            LOG_REQUEST_REOPEN();
+            break;
+
+        default:
+            break;
+        }
     }
     else
     {
@@ -1,5 +1,17 @@
 #include "hao_algorithm.h"
 
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAO_CRC_PCLMUL 1
+#endif
+
+#if defined(__x86_64__)
+#define HAO_CRC32C_SSE42 1
+#endif
+
 static uint32_t CRC_TABLE[256]
 {
     0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
@@ -48,12 +60,445 @@ static uint32_t CRC_TABLE[256]
 };
 
 
+namespace
+{
+    constexpr uint32_t kCRCPolynomial{0x04c11db7};
+    constexpr uint32_t kCRCInit{0xffffffff};
+
+    uint32_t Bytewise(uint32_t crc, const unsigned char *data, size_t len)
+    {
+        while(len--)
+        {
+            crc = (crc << 8) ^ CRC_TABLE[((crc >> 24) ^ *data++) & 0xFF];
+        }
+        return crc;
+    }
+
+    // slicing-by-8的查表，table[k][i]是字节i后面再跟k个0字节时对CRC的贡献，table[0]就是CRC_TABLE
+    struct SliceTables
+    {
+        uint32_t table[8][256];
+        SliceTables()
+        {
+            for(int i = 0; i < 256; ++i)
+            {
+                table[0][i] = CRC_TABLE[i];
+            }
+            for(int k = 1; k < 8; ++k)
+            {
+                for(int i = 0; i < 256; ++i)
+                {
+                    uint32_t prev = table[k - 1][i];
+                    table[k][i] = (prev << 8) ^ CRC_TABLE[prev >> 24];
+                }
+            }
+        }
+    };
+
+    const SliceTables kSlice;
+
+    uint32_t Slicing8(uint32_t crc, const unsigned char *data, size_t len)
+    {
+        const auto& t = kSlice.table;
+        while(len >= 8)
+        {
+            // 前4个字节和CRC合并，高位在前
+            uint32_t high = crc ^ (static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16
+                                    | static_cast<uint32_t>(data[2]) << 8 | data[3]);
+            crc = t[7][high >> 24] ^ t[6][(high >> 16) & 0xFF] ^ t[5][(high >> 8) & 0xFF] ^ t[4][high & 0xFF]
+                ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+            data += 8;
+            len -= 8;
+        }
+        return Bytewise(crc, data, len);
+    }
+
+#ifdef HAO_CRC_PCLMUL
+    // x^n mod P
+    uint32_t XPowMod(int n)
+    {
+        uint32_t r{1};
+        while(n--)
+        {
+            r = (r << 1) ^ ((r & 0x80000000) ? kCRCPolynomial : 0);
+        }
+        return r;
+    }
+
+    // 折叠用的常数：高64位乘x^(d+64) mod P，低64位乘x^d mod P，d是折叠的距离
+    struct FoldConstants
+    {
+        __m128i fold128;
+        __m128i fold512;
+        FoldConstants()
+        {
+            fold128 = _mm_set_epi64x(XPowMod(128 + 64), XPowMod(128));
+            fold512 = _mm_set_epi64x(XPowMod(512 + 64), XPowMod(512));
+        }
+    };
+
+    const FoldConstants kFold;
+
+    // 把128位的x往后折叠d位再加上next，和原来的值模P同余
+    __attribute__((target("pclmul,ssse3")))
+    inline __m128i Fold(__m128i x, __m128i next, __m128i constants)
+    {
+        __m128i high = _mm_clmulepi64_si128(x, constants, 0x11);
+        __m128i low = _mm_clmulepi64_si128(x, constants, 0x00);
+        return _mm_xor_si128(_mm_xor_si128(high, low), next);
+    }
+
+    // 按大端读16个字节，第一个字节是最高次的系数
+    __attribute__((target("pclmul,ssse3")))
+    inline __m128i LoadBlock(const unsigned char *data, __m128i reverse)
+    {
+        return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), reverse);
+    }
+
+    // 高位在前的CRC就是 (M(x)*x^32 + init*x^(8n)) mod P，把init异或进前4个字节后只剩 M'(x)*x^32 mod P
+    // 先用无进位乘法把整段数据折叠成一个和M'(x)同余的128位的值，再用查表对这16个字节和剩下的尾巴算CRC
+    __attribute__((target("pclmul,ssse3")))
+    uint32_t Pclmul(const unsigned char *data, size_t len)
+    {
+        if(len < 64)
+        {
+            return Slicing8(kCRCInit, data, len);
+        }
+        const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m128i init = _mm_set_epi32(static_cast<int>(kCRCInit), 0, 0, 0);
+        __m128i x0 = _mm_xor_si128(LoadBlock(data, reverse), init);
+        data += 16;
+        len -= 16;
+        if(len >= 112)
+        {
+            // 4路并行，每路每次折叠512位
+            __m128i x1 = LoadBlock(data, reverse);
+            __m128i x2 = LoadBlock(data + 16, reverse);
+            __m128i x3 = LoadBlock(data + 32, reverse);
+            data += 48;
+            len -= 48;
+            while(len >= 64)
+            {
+                x0 = Fold(x0, LoadBlock(data, reverse), kFold.fold512);
+                x1 = Fold(x1, LoadBlock(data + 16, reverse), kFold.fold512);
+                x2 = Fold(x2, LoadBlock(data + 32, reverse), kFold.fold512);
+                x3 = Fold(x3, LoadBlock(data + 48, reverse), kFold.fold512);
+                data += 64;
+                len -= 64;
+            }
+            x0 = Fold(x0, x1, kFold.fold128);
+            x0 = Fold(x0, x2, kFold.fold128);
+            x0 = Fold(x0, x3, kFold.fold128);
+        }
+        while(len >= 16)
+        {
+            x0 = Fold(x0, LoadBlock(data, reverse), kFold.fold128);
+            data += 16;
+            len -= 16;
+        }
+        alignas(16) unsigned char folded[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(folded), _mm_shuffle_epi8(x0, reverse));
+        uint32_t crc = Slicing8(0, folded, sizeof(folded));
+        return Slicing8(crc, data, len);
+    }
+
+    bool CpuHasPclmul()
+    {
+        unsigned int eax{0}, ebx{0}, ecx{0}, edx{0};
+        if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            return false;
+        }
+        return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+    }
+#else
+    bool CpuHasPclmul()
+    {
+        return false;
+    }
+#endif
+
+    using CRCFunction = uint32_t (*)(const unsigned char *data, size_t len);
+
+    struct CRCImpl
+    {
+        CRCFunction function;
+        const char* name;
+    };
+
+    CRCImpl SelectCRC()
+    {
+        if(CpuHasPclmul())
+        {
+            return {GetCRCPclmul, "pclmul"};
+        }
+        return {GetCRCSlicing8, "slicing-by-8"};
+    }
+
+    const CRCImpl kCRCImpl{SelectCRC()};
+}
+
 uint32_t GetCRC(const unsigned char *data, size_t len)
 {
-    uint32_t crc{0xffffffff};
-    while(len--)
+    return kCRCImpl.function(data, len);
+}
+
+uint32_t GetCRCBytewise(const unsigned char *data, size_t len)
+{
+    return Bytewise(kCRCInit, data, len);
+}
+
+uint32_t GetCRCSlicing8(const unsigned char *data, size_t len)
+{
+    return Slicing8(kCRCInit, data, len);
+}
+
+bool HasCRCPclmul()
+{
+    static const bool has_pclmul{CpuHasPclmul()};
+    return has_pclmul;
+}
+
+uint32_t GetCRCPclmul(const unsigned char *data, size_t len)
+{
+#ifdef HAO_CRC_PCLMUL
+    if(HasCRCPclmul())
+    {
+        return Pclmul(data, len);
+    }
+#endif
+    return Slicing8(kCRCInit, data, len);
+}
+
+const char* GetCRCName()
+{
+    return kCRCImpl.name;
+}
+
+namespace
+{
+    constexpr uint32_t kCRC32CPolynomial{0x82f63b78};
+
+    // CRC32C是低位在前的CRC，查表法的表在启动时生成
+    struct CRC32CTable
+    {
+        uint32_t table[256];
+        CRC32CTable()
+        {
+            for(uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for(int bit = 0; bit < 8; ++bit)
+                {
+                    crc = (crc >> 1) ^ ((crc & 1) ? kCRC32CPolynomial : 0);
+                }
+                table[i] = crc;
+            }
+        }
+    };
+
+    const CRC32CTable kCRC32C;
+
+    uint32_t CRC32CBytewise(const unsigned char *data, size_t len)
+    {
+        uint32_t crc{0xffffffff};
+        while(len--)
+        {
+            crc = (crc >> 8) ^ kCRC32C.table[(crc ^ *data++) & 0xFF];
+        }
+        return ~crc;
+    }
+
+#ifdef HAO_CRC32C_SSE42
+    __attribute__((target("sse4.2")))
+    uint32_t CRC32CHardware(const unsigned char *data, size_t len)
+    {
+        uint64_t crc{0xffffffff};
+        while(len >= 8)
+        {
+            uint64_t value;
+            std::memcpy(&value, data, sizeof(value));
+            crc = _mm_crc32_u64(crc, value);
+            data += 8;
+            len -= 8;
+        }
+        uint32_t crc32 = static_cast<uint32_t>(crc);
+        while(len--)
+        {
+            crc32 = _mm_crc32_u8(crc32, *data++);
+        }
+        return ~crc32;
+    }
+
+    bool CpuHasSSE42()
+    {
+        unsigned int eax{0}, ebx{0}, ecx{0}, edx{0};
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+    }
+#endif
+
+    using CRC32CFunction = uint32_t (*)(const unsigned char *data, size_t len);
+
+    CRC32CFunction SelectCRC32C()
+    {
+#ifdef HAO_CRC32C_SSE42
+        if(CpuHasSSE42())
+        {
+            return CRC32CHardware;
+        }
+#endif
+        return CRC32CBytewise;
+    }
+
+    const CRC32CFunction kCRC32CImpl{SelectCRC32C()};
+
+    constexpr uint64_t kPrime64_1{0x9E3779B185EBCA87ULL};
+    constexpr uint64_t kPrime64_2{0xC2B2AE3D27D4EB4FULL};
+    constexpr uint64_t kPrime64_3{0x165667B19E3779F9ULL};
+    constexpr uint64_t kPrime64_4{0x85EBCA77C2B2AE63ULL};
+    constexpr uint64_t kPrime64_5{0x27D4EB2F165667C5ULL};
+
+    inline uint64_t RotateLeft64(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    inline uint64_t Read64(const unsigned char *data)
+    {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    inline uint32_t Read32(const unsigned char *data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t XXH64Round(uint64_t acc, uint64_t input)
+    {
+        acc += input * kPrime64_2;
+        acc = RotateLeft64(acc, 31);
+        return acc * kPrime64_1;
+    }
+
+    inline uint64_t XXH64MergeRound(uint64_t acc, uint64_t value)
+    {
+        acc ^= XXH64Round(0, value);
+        return acc * kPrime64_1 + kPrime64_4;
+    }
+
+    // 各个校验算法的包装
+    uint32_t ComputeCRC32(const unsigned char *data, size_t len)
+    {
+        return GetCRC(data, len);
+    }
+
+    uint32_t ComputeXXHash64(const unsigned char *data, size_t len)
+    {
+        uint64_t hash = GetXXHash64(data, len);
+        return static_cast<uint32_t>(hash ^ (hash >> 32));
+    }
+
+    uint32_t ComputeNone(const unsigned char *, size_t)
+    {
+        return 0;
+    }
+
+    template<uint32_t (*Compute)(const unsigned char *data, size_t len)>
+    bool Verify(const unsigned char *data, size_t len, uint32_t expected)
+    {
+        return Compute(data, len) == expected;
+    }
+
+    bool VerifyNone(const unsigned char *, size_t, uint32_t)
+    {
+        return true;
+    }
+
+    const Checksum kChecksums[]
+    {
+        {"crc32",       ComputeCRC32,       Verify<ComputeCRC32>},
+        {"crc32c",      GetCRC32C,          Verify<GetCRC32C>},
+        {"xxhash64",    ComputeXXHash64,    Verify<ComputeXXHash64>},
+        {"none",        ComputeNone,        VerifyNone},
+    };
+}
+
+uint32_t GetCRC32C(const unsigned char *data, size_t len)
+{
+    return kCRC32CImpl(data, len);
+}
+
+uint64_t GetXXHash64(const unsigned char *data, size_t len, uint64_t seed)
+{
+    const unsigned char *end = data + len;
+    uint64_t hash{0};
+    if(len >= 32)
+    {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + kPrime64_1 + kPrime64_2;
+        uint64_t v2 = seed + kPrime64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime64_1;
+        do
+        {
+            v1 = XXH64Round(v1, Read64(data));
+            v2 = XXH64Round(v2, Read64(data + 8));
+            v3 = XXH64Round(v3, Read64(data + 16));
+            v4 = XXH64Round(v4, Read64(data + 24));
+            data += 32;
+        } while(data <= limit);
+        hash = RotateLeft64(v1, 1) + RotateLeft64(v2, 7) + RotateLeft64(v3, 12) + RotateLeft64(v4, 18);
+        hash = XXH64MergeRound(hash, v1);
+        hash = XXH64MergeRound(hash, v2);
+        hash = XXH64MergeRound(hash, v3);
+        hash = XXH64MergeRound(hash, v4);
+    }
+    else
+    {
+        hash = seed + kPrime64_5;
+    }
+    hash += static_cast<uint64_t>(len);
+    while(data + 8 <= end)
+    {
+        hash ^= XXH64Round(0, Read64(data));
+        hash = RotateLeft64(hash, 27) * kPrime64_1 + kPrime64_4;
+        data += 8;
+    }
+    if(data + 4 <= end)
+    {
+        hash ^= static_cast<uint64_t>(Read32(data)) * kPrime64_1;
+        hash = RotateLeft64(hash, 23) * kPrime64_2 + kPrime64_3;
+        data += 4;
+    }
+    while(data < end)
+    {
+        hash ^= (*data++) * kPrime64_5;
+        hash = RotateLeft64(hash, 11) * kPrime64_1;
+    }
+    hash ^= hash >> 33;
+    hash *= kPrime64_2;
+    hash ^= hash >> 29;
+    hash *= kPrime64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+const Checksum* FindChecksum(std::string_view name)
+{
+    if(name.empty())
+    {
+        return &kChecksums[0];
+    }
+    for(const Checksum& checksum : kChecksums)
     {
-        crc = (crc << 8) ^ CRC_TABLE[((crc >> 24) ^ *data++) & 0xFF];
+        if(name == checksum.name)
+        {
+            return &checksum;
+        }
     }
-    return crc;
+    return nullptr;
 }
\ No newline at end of file
@@ -318,6 +318,11 @@ void Buffer::Shrink(size_t reserve)
     swap(temp);
 }
 
+size_t Buffer::InternalCapacity() const
+{
+    return buffer_.capacity();
+}
+
 char* Buffer::Begin()
 {
     return &*buffer_.begin();
@@ -1,28 +1,402 @@
 #include "hao_memory.h"
 #include "hao_log.h"
+#include <sys/mman.h>
 #include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#ifdef HAO_MEMORY_STATS
+#include "hao_timestamp.h"
+#include <sstream>
+#endif
 using namespace hao_log;
+using std::lock_guard;
 
+namespace
+{
+    struct Slab;
+
+    // 每个内存块前面的块头，记录块属于哪个slab以及大小级别
+    struct BlockHeader
+    {
+        // 为nullptr表示这是直接malloc出来的大块内存
+        Slab*                   slab;
+        uint32_t                size_class;
+        // 统计开启时记录使用者申请的大小
+        uint32_t                request_size;
+    };
+    // 块头16字节，保证返回给使用者的地址是16字节对齐的
+    static_assert(sizeof(BlockHeader) == 16, "BlockHeader must keep 16-byte alignment");
+
+    // 最小的级别是64字节(含块头)，之后每级翻倍，到32K为止，能放下一个最大的包
+    constexpr int           kMinClassShift{6};
+    constexpr int           kClassCount{10};
+    constexpr std::size_t   kMaxBlockSize{std::size_t(1) << (kMinClassShift + kClassCount - 1)};
+    constexpr uint32_t      kLargeClass{UINT32_MAX};
+    // 每次从系统申请的slab大小，大级别至少切出2块
+    constexpr std::size_t   kSlabSize{64 * 1024};
+    // 每个级别完全空闲的slab超过这个数时，把多出来的一半还给系统
+    constexpr uint32_t      kMaxEmptySlabs{8};
+
+    // 从系统直接mmap出来的一块内存，释放时munmap，不会留在malloc的堆里
+    struct Slab
+    {
+        Memory::ThreadCache*    owner;
+        char*                   memory;
+        std::size_t             bytes;
+        // 已经分配出去的块数，包括其他线程释放了但所属线程还没取回的，只有所属线程访问
+        uint32_t                used;
+        // 整理空闲链表时标记要还给系统的slab
+        bool                    releasing;
+    };
+
+    // 空闲块的next指针借用块头后面的空间存放
+    inline BlockHeader*& NextOf(BlockHeader* block)
+    {
+        return *reinterpret_cast<BlockHeader**>(block + 1);
+    }
+
+    // 含块头的总大小对应的级别
+    inline int ClassIndex(std::size_t total)
+    {
+        if(total <= (std::size_t(1) << kMinClassShift))
+        {
+            return 0;
+        }
+        return 64 - __builtin_clzl(total - 1) - kMinClassShift;
+    }
+}
+
+struct Memory::ThreadCache
+{
+    // 各级别的空闲链表，只有所属线程访问
+    BlockHeader*                free_list[kClassCount]{};
+    // 各级别完全空闲的slab数，只有所属线程访问
+    uint32_t                    empty_slabs[kClassCount]{};
+    // 其他线程释放的内存块，无锁压栈，所属线程一次全部取走
+    std::atomic<BlockHeader*>   remote_free{nullptr};
+#ifdef HAO_MEMORY_STATS
+    // 本线程分配和释放的次数，最后一项是大块内存，只有本线程写，打印时其他线程读
+    std::atomic<uint64_t>       alloc_count[kClassCount + 1]{};
+    std::atomic<uint64_t>       free_count[kClassCount + 1]{};
+
+    static void Increase(std::atomic<uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+#endif
+
+    // 从空闲链表取出一块
+    BlockHeader* Pop(int index)
+    {
+        BlockHeader* block = free_list[index];
+        if(block == nullptr)
+        {
+            return nullptr;
+        }
+        free_list[index] = NextOf(block);
+        if(block->slab->used++ == 0)
+        {
+            --empty_slabs[index];
+        }
+        return block;
+    }
+
+    // 把本线程的块挂回空闲链表，空闲的slab太多时还一部分给系统
+    void Push(BlockHeader* block)
+    {
+        const uint32_t index = block->size_class;
+        NextOf(block) = free_list[index];
+        free_list[index] = block;
+        if(--block->slab->used == 0 && ++empty_slabs[index] > kMaxEmptySlabs)
+        {
+            Trim(index);
+        }
+    }
+
+    // 把其他线程还回来的内存块挂回空闲链表
+    void CollectRemote()
+    {
+        BlockHeader* block = remote_free.exchange(nullptr, std::memory_order_acquire);
+        while(block != nullptr)
+        {
+            BlockHeader* next = NextOf(block);
+            Push(block);
+            block = next;
+        }
+    }
+
+    // 从系统申请一个slab，切成同样大小的块挂到空闲链表上
+    void Refill(int index)
+    {
+        const std::size_t block_size = std::size_t(1) << (index + kMinClassShift);
+        const std::size_t count = std::max(kSlabSize / block_size, std::size_t(2));
+        void* memory = mmap(nullptr, block_size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED)
+        {
+            return;
+        }
+        Slab* slab = new Slab{this, static_cast<char*>(memory), block_size * count, 0, false};
+#ifdef HAO_MEMORY_STATS
+        Memory::GetInstance().slab_bytes_.fetch_add(slab->bytes, std::memory_order_relaxed);
+#endif
+        for(std::size_t i = count; i > 0; --i)
+        {
+            BlockHeader* block = reinterpret_cast<BlockHeader*>(slab->memory + (i - 1) * block_size);
+            block->slab = slab;
+            block->size_class = index;
+            NextOf(block) = free_list[index];
+            free_list[index] = block;
+        }
+        ++empty_slabs[index];
+    }
+
+    // 把一个级别一半的空闲slab还给系统
+    // 空闲slab的块散落在空闲链表中，第一遍选出要还的slab，第二遍把它们的块从链表中摘掉
+    // 空闲slab超过上限才会走到这里，每次至少还kMaxEmptySlabs/2个，整理链表的开销是摊开的
+    void Trim(uint32_t index)
+    {
+        std::vector<Slab*> releasing;
+        uint32_t release_count = empty_slabs[index] - kMaxEmptySlabs / 2;
+        for(BlockHeader* block = free_list[index]; block != nullptr && releasing.size() < release_count; block = NextOf(block))
+        {
+            Slab* slab = block->slab;
+            if(slab->used == 0 && !slab->releasing)
+            {
+                slab->releasing = true;
+                releasing.push_back(slab);
+            }
+        }
+        BlockHeader** link = &free_list[index];
+        while(*link != nullptr)
+        {
+            if((*link)->slab->releasing)
+            {
+                *link = NextOf(*link);
+            }
+            else
+            {
+                link = &NextOf(*link);
+            }
+        }
+        for(Slab* slab : releasing)
+        {
+#ifdef HAO_MEMORY_STATS
+            Memory::GetInstance().slab_bytes_.fetch_sub(slab->bytes, std::memory_order_relaxed);
+#endif
+            munmap(slab->memory, slab->bytes);
+            delete slab;
+        }
+        empty_slabs[index] -= releasing.size();
+    }
+};
+
+namespace
+{
+    thread_local Memory::ThreadCache* tls_cache{nullptr};
+}
+
+// 线程退出时交出缓存
+struct CacheHolder
+{
+    bool active{false};
+    ~CacheHolder()
+    {
+        if(tls_cache != nullptr)
+        {
+            Memory::GetInstance().OrphanCache(tls_cache);
+            tls_cache = nullptr;
+        }
+    }
+};
+
+namespace
+{
+    thread_local CacheHolder tls_holder;
+}
+
+// 故意不析构：线程池、日志等线程可能在静态对象析构之后才退出，那时CacheHolder还要用到它
 Memory& Memory::GetInstance()
 {
-    static Memory memory_;
+    static Memory& memory_ = *new Memory();
     return memory_;
 }
 
+Memory::ThreadCache* Memory::LocalCache()
+{
+    if(tls_cache != nullptr)
+    {
+        return tls_cache;
+    }
+    {
+        lock_guard<std::mutex> lock(orphan_mutex_);
+        if(!orphan_caches_.empty())
+        {
+            tls_cache = orphan_caches_.back();
+            orphan_caches_.pop_back();
+        }
+    }
+    if(tls_cache == nullptr)
+    {
+        tls_cache = new ThreadCache();
+#ifdef HAO_MEMORY_STATS
+        lock_guard<std::mutex> lock(orphan_mutex_);
+        all_caches_.push_back(tls_cache);
+#endif
+    }
+    // 用到tls_holder才会在本线程注册它的析构函数
+    tls_holder.active = true;
+    return tls_cache;
+}
+
+void Memory::OrphanCache(ThreadCache* cache)
+{
+    lock_guard<std::mutex> lock(orphan_mutex_);
+    orphan_caches_.push_back(cache);
+}
+
 void* Memory::AllocMemory(std::size_t size, bool init_zero)
 {
+    const std::size_t total = size + sizeof(BlockHeader);
+    if(total > kMaxBlockSize)
+    {
+        BlockHeader* block = static_cast<BlockHeader*>(init_zero ? std::calloc(total, sizeof(char)) : std::malloc(total));
+        if(block == nullptr)
+        {
+            return nullptr;
+        }
+        block->slab = nullptr;
+        block->size_class = kLargeClass;
+#ifdef HAO_MEMORY_STATS
+        block->request_size = static_cast<uint32_t>(size);
+        ThreadCache::Increase(LocalCache()->alloc_count[kClassCount]);
+        AddLiveBytes(size);
+#endif
+        return block + 1;
+    }
+
+    ThreadCache* cache = LocalCache();
+    const int index = ClassIndex(total);
+    if(cache->free_list[index] == nullptr)
+    {
+        cache->CollectRemote();
+    }
+    if(cache->free_list[index] == nullptr)
+    {
+        cache->Refill(index);
+    }
+    BlockHeader* block = cache->Pop(index);
+    if(block == nullptr)
+    {
+        return nullptr;
+    }
+#ifdef HAO_MEMORY_STATS
+    block->request_size = static_cast<uint32_t>(size);
+    ThreadCache::Increase(cache->alloc_count[index]);
+    AddLiveBytes(size);
+#endif
     if(init_zero)
     {
-        return std::calloc(size, sizeof(char));
+        std::memset(block + 1, 0, size);
+    }
+    return block + 1;
+}
+
+void Memory::FreeMemory(void *ptr)
+{
+    if(ptr == nullptr)
+    {
+        return;
+    }
+    BlockHeader* block = static_cast<BlockHeader*>(ptr) - 1;
+    ThreadCache* owner = block->slab == nullptr ? nullptr : block->slab->owner;
+#ifdef HAO_MEMORY_STATS
+    // 释放次数记在释放线程自己的缓存上，汇总后和分配次数相减就是在用的块数
+    ThreadCache::Increase(LocalCache()->free_count[owner == nullptr ? kClassCount : block->size_class]);
+    live_bytes_.fetch_sub(block->request_size, std::memory_order_relaxed);
+#endif
+    if(owner == nullptr)
+    {
+        std::free(block);
+    }
+    else if(owner == tls_cache)
+    {
+        owner->Push(block);
     }
     else
     {
-        return std::malloc(size);
+        // 不是本线程分配的，还给所属线程
+        BlockHeader* head = owner->remote_free.load(std::memory_order_relaxed);
+        do
+        {
+            NextOf(block) = head;
+        } while(!owner->remote_free.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
     }
 }
 
-void Memory::FreeMemory(void *ptr)
+#ifdef HAO_MEMORY_STATS
+void Memory::AddLiveBytes(std::size_t size)
+{
+    int64_t live = live_bytes_.fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t peak = peak_bytes_.load(std::memory_order_relaxed);
+    while(live > peak && !peak_bytes_.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+    {
+
+    }
+}
+
+void Memory::PrintStats()
 {
-    
-    std::free(ptr);
+    uint64_t allocs[kClassCount + 1]{};
+    uint64_t frees[kClassCount + 1]{};
+    {
+        lock_guard<std::mutex> lock(orphan_mutex_);
+        for(ThreadCache* cache : all_caches_)
+        {
+            for(int i = 0; i <= kClassCount; ++i)
+            {
+                allocs[i] += cache->alloc_count[i].load(std::memory_order_relaxed);
+                frees[i] += cache->free_count[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    uint64_t total_allocs{0};
+    uint64_t total_frees{0};
+    // 各级别 块大小:累计分配次数/在用块数
+    std::ostringstream histogram;
+    for(int i = 0; i <= kClassCount; ++i)
+    {
+        total_allocs += allocs[i];
+        total_frees += frees[i];
+        if(allocs[i] == 0)
+        {
+            continue;
+        }
+        if(i == kClassCount)
+        {
+            histogram << " large:";
+        }
+        else
+        {
+            histogram << ' ' << (std::size_t(1) << (i + kMinClassShift)) << ':';
+        }
+        histogram << allocs[i] << '/' << static_cast<int64_t>(allocs[i] - frees[i]);
+    }
+
+    int64_t now = Timestamp::now().Microseconds();
+    int64_t alloc_per_sec{0};
+    if(last_print_time_ != 0 && now > last_print_time_)
+    {
+        alloc_per_sec = static_cast<int64_t>(total_allocs - last_alloc_count_) * Timestamp::kMicroSecondsPerSecond / (now - last_print_time_);
+    }
+    last_alloc_count_ = total_allocs;
+    last_print_time_ = now;
+
+    LOG_NOTICE << "内存统计 在用字节:" << live_bytes_.load(std::memory_order_relaxed)
+                << " 峰值字节:" << peak_bytes_.load(std::memory_order_relaxed)
+                << " slab字节:" << slab_bytes_.load(std::memory_order_relaxed)
+                << " 在用块数:" << static_cast<int64_t>(total_allocs - total_frees)
+                << " 每秒分配:" << alloc_per_sec;
+    LOG_NOTICE << "内存统计 块大小:累计分配/在用" << histogram.str();
 }
+#endif
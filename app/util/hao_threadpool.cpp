@@ -1,10 +1,23 @@
 #include "hao_threadpool.h"
 
+#include <algorithm>
+
+namespace
+{
+    // 当前线程是哪个线程池的第几个工作线程，工作线程投递的任务优先放进自己的队列
+    thread_local const ThreadPool*          tls_pool{nullptr};
+    thread_local ThreadPool::concurrency_t  tls_index{0};
+}
+
 ThreadPool::ThreadPool()
-    : waiting_{false}, running_{false},paused_{false},
-      tasks_total_{0},
+    : overflow_count_{0},
       thread_count_{0},
-      threads_{nullptr}
+      tasks_total_{0},
+      threads_{nullptr},
+      workers_{nullptr},
+      next_worker_{0},
+      idle_count_{0},
+      waiting_{false}, running_{false},paused_{false}
 {
 }
 
@@ -16,14 +29,19 @@ ThreadPool::~ThreadPool()
 
 size_t ThreadPool::WaitingCount() const
 {
-    scoped_lock task_lock{tasks_mutex_};
-    return tasks_.size();
+    size_t count = overflow_count_;
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        count += workers_[i]->queue.Size() + workers_[i]->pinned.Size() + workers_[i]->pinned_overflow_count;
+    }
+    return count;
 }
 
 size_t ThreadPool::RunningCount() const
 {
-    scoped_lock task_lock{tasks_mutex_};
-    return tasks_total_ - tasks_.size();
+    size_t waiting = WaitingCount();
+    size_t total = tasks_total_;
+    return total > waiting ? total - waiting : 0;
 }
 
 size_t ThreadPool::TasksTotal() const
@@ -41,7 +59,7 @@ void ThreadPool::WaitForTasks()
     waiting_ = true;
     unique_lock<mutex> tasks_lock{tasks_mutex_};
     task_done_cv_.wait(tasks_lock, [&]{
-        return (tasks_total_ == (paused_? tasks_.size() : 0));
+        return (tasks_total_ == (paused_? WaitingCount() : 0));
     });
     waiting_ = false;
 }
@@ -71,54 +89,360 @@ void ThreadPool::Reset(const concurrency_t thread_count)
     paused_ =  true;
     WaitForTasks();
     DestoryThreads();
-    thread_count_ = DetermineThreadCount(thread_count);
-    threads_ = make_unique<thread[]>(thread_count);
     paused_ = was_paused;
-    CreateThreads();
+    CreateThreads(thread_count);
 }
 
 void ThreadPool::CreateThreads(const concurrency_t  thread_count)
 {
     thread_count_ = DetermineThreadCount(thread_count);
-    threads_ = make_unique<thread[]>(DetermineThreadCount(thread_count));
+    workers_ = make_unique<unique_ptr<Worker>[]>(thread_count_);
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        workers_[i] = make_unique<Worker>(kQueueCapacity);
+    }
+    threads_ = make_unique<thread[]>(thread_count_);
     running_ = true;
     for(concurrency_t i{0}; i < thread_count_; ++i)
     {
-        threads_[i] = thread(&ThreadPool::WorkerThread, this);
+        threads_[i] = thread(&ThreadPool::WorkerThread, this, i);
     }
 }
 
 void ThreadPool::DestoryThreads()
 {
     running_ = false;
-    task_available_cv_.notify_all();
+    WakeAll();
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        if(threads_[i].joinable())
+        {
+            threads_[i].join();
+        }
+    }
+}
+
+void ThreadPool::Push(Task&& task)
+{
+    ++tasks_total_;
+    if(thread_count_ == 0)
+    {
+        // 线程还没创建，先放到溢出队列里
+        scoped_lock lock{tasks_mutex_};
+        overflow_tasks_.push_back(std::move(task));
+        ++overflow_count_;
+        return;
+    }
+    concurrency_t index = (tls_pool == this) ? tls_index : next_worker_.fetch_add(1, std::memory_order_relaxed) % thread_count_;
+    bool pushed{false};
     for(concurrency_t i{0}; i < thread_count_; ++i)
     {
-        threads_[i].join();
+        concurrency_t target = (index + i) % thread_count_;
+        if(workers_[target]->queue.TryPush(task))
+        {
+            index = target;
+            pushed = true;
+            break;
+        }
+    }
+    if(!pushed)
+    {
+        scoped_lock lock{tasks_mutex_};
+        overflow_tasks_.push_back(std::move(task));
+        ++overflow_count_;
+    }
+    // 和工作线程睡眠前的检查配对，保证不会出现任务入队了但是所有线程都在睡的情况
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(WakeWorker(index) || idle_count_.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    // 目标线程正忙，唤醒一个空闲线程来偷
+    for(concurrency_t i{1}; i < thread_count_; ++i)
+    {
+        if(WakeWorker((index + i) % thread_count_))
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::PushPinned(size_t key, Task&& task)
+{
+    if(thread_count_ == 0)
+    {
+        Push(std::move(task));
+        return;
+    }
+    ++tasks_total_;
+    concurrency_t index = key % thread_count_;
+    Worker& worker = *workers_[index];
+    // 溢出队列中还有任务时，新任务也只能排在后面
+    if(worker.pinned_overflow_count.load(std::memory_order_acquire) > 0 || !worker.pinned.TryPush(task))
+    {
+        scoped_lock lock{worker.pinned_mutex};
+        worker.pinned_overflow.push_back(std::move(task));
+        ++worker.pinned_overflow_count;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // 只能由这个线程执行，不用去唤醒别的线程
+    WakeWorker(index);
+}
+
+void ThreadPool::PushRun(concurrency_t index, Task* tasks, size_t count, bool pinned)
+{
+    Worker& worker = *workers_[index];
+    if(pinned)
+    {
+        size_t pushed{0};
+        if(worker.pinned_overflow_count.load(std::memory_order_acquire) == 0)
+        {
+            pushed = worker.pinned.TryPushBulk(tasks, count);
+        }
+        if(pushed < count)
+        {
+            scoped_lock lock{worker.pinned_mutex};
+            for(size_t i = pushed; i < count; ++i)
+            {
+                worker.pinned_overflow.push_back(std::move(tasks[i]));
+            }
+            worker.pinned_overflow_count += count - pushed;
+        }
+        return;
+    }
+    size_t pushed = worker.queue.TryPushBulk(tasks, count);
+    // 放不下的先试试别的线程的队列
+    for(concurrency_t i{1}; pushed < count && i < thread_count_; ++i)
+    {
+        pushed += workers_[(index + i) % thread_count_]->queue.TryPushBulk(tasks + pushed, count - pushed);
+    }
+    if(pushed < count)
+    {
+        scoped_lock lock{tasks_mutex_};
+        for(size_t i = pushed; i < count; ++i)
+        {
+            overflow_tasks_.push_back(std::move(tasks[i]));
+        }
+        overflow_count_ += count - pushed;
     }
 }
 
-void ThreadPool::WorkerThread()
+void ThreadPool::PushBatch(TaskBatch& batch)
 {
+    if(batch.Empty())
+    {
+        return;
+    }
+    if(thread_count_ == 0)
+    {
+        for(Task& task : batch.shared_)
+        {
+            Push(std::move(task));
+        }
+        for(auto& [key, task] : batch.pinned_)
+        {
+            Push(std::move(task));
+        }
+        batch.shared_.clear();
+        batch.pinned_.clear();
+        return;
+    }
+    tasks_total_ += batch.Size();
+    // 这一批投递到了哪些线程，最后每个线程唤醒一次
+    static thread_local vector<char> touched;
+    touched.assign(thread_count_, 0);
+
+    // 非固定任务平均分给连续的几个线程
+    const size_t shared_count = batch.shared_.size();
+    if(shared_count > 0)
+    {
+        const size_t targets = std::min<size_t>(shared_count, thread_count_);
+        const size_t chunk = (shared_count + targets - 1) / targets;
+        const concurrency_t start = next_worker_.fetch_add(targets, std::memory_order_relaxed) % thread_count_;
+        for(size_t j = 0, begin = 0; begin < shared_count; ++j, begin += chunk)
+        {
+            concurrency_t index = (start + j) % thread_count_;
+            PushRun(index, batch.shared_.data() + begin, std::min(chunk, shared_count - begin), false);
+            touched[index] = 1;
+        }
+        batch.shared_.clear();
+    }
+
+    // 固定任务按线程做一次稳定的计数排序，同一个线程的任务保持原来的先后顺序
+    const size_t pinned_count = batch.pinned_.size();
+    if(pinned_count > 0)
+    {
+        batch.offsets_.assign(thread_count_ + 1, 0);
+        for(auto& [key, task] : batch.pinned_)
+        {
+            ++batch.offsets_[key % thread_count_ + 1];
+        }
+        for(concurrency_t i{0}; i < thread_count_; ++i)
+        {
+            batch.offsets_[i + 1] += batch.offsets_[i];
+        }
+        batch.sorted_.resize(pinned_count);
+        for(auto& [key, task] : batch.pinned_)
+        {
+            batch.sorted_[batch.offsets_[key % thread_count_]++] = std::move(task);
+        }
+        // 经过上面的循环，offsets_[i]变成了第i个线程的结束位置
+        size_t begin{0};
+        for(concurrency_t i{0}; i < thread_count_; ++i)
+        {
+            size_t end = batch.offsets_[i];
+            if(end > begin)
+            {
+                PushRun(i, batch.sorted_.data() + begin, end - begin, true);
+                touched[i] = 1;
+            }
+            begin = end;
+        }
+        batch.pinned_.clear();
+        batch.sorted_.clear();
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        if(touched[i])
+        {
+            WakeWorker(i);
+        }
+    }
+}
+
+bool ThreadPool::WakeWorker(concurrency_t index)
+{
+    Worker& worker = *workers_[index];
+    if(!worker.sleeping.load(std::memory_order_seq_cst))
+    {
+        return false;
+    }
+    {
+        scoped_lock lock{worker.sleep_mutex};
+        if(!worker.sleeping)
+        {
+            return false;
+        }
+        worker.sleeping = false;
+    }
+    worker.sleep_cv.notify_one();
+    return true;
+}
+
+void ThreadPool::WakeAll()
+{
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        Worker& worker = *workers_[i];
+        {
+            scoped_lock lock{worker.sleep_mutex};
+            worker.sleeping = false;
+        }
+        worker.sleep_cv.notify_one();
+    }
+}
+
+bool ThreadPool::TakeTask(concurrency_t index, Task& task)
+{
+    Worker& self = *workers_[index];
+    // 固定给本线程的任务优先
+    if(self.pinned.TryPop(task))
+    {
+        return true;
+    }
+    if(self.pinned_overflow_count.load(std::memory_order_acquire) > 0)
+    {
+        scoped_lock lock{self.pinned_mutex};
+        if(!self.pinned_overflow.empty())
+        {
+            task = std::move(self.pinned_overflow.front());
+            self.pinned_overflow.pop_front();
+            --self.pinned_overflow_count;
+            return true;
+        }
+    }
+    if(self.queue.TryPop(task))
+    {
+        return true;
+    }
+    // 自己的队列空了，从下一个线程开始偷
+    for(concurrency_t i{1}; i < thread_count_; ++i)
+    {
+        if(workers_[(index + i) % thread_count_]->queue.TryPop(task))
+        {
+            return true;
+        }
+    }
+    if(overflow_count_.load(std::memory_order_relaxed) > 0)
+    {
+        scoped_lock lock{tasks_mutex_};
+        if(!overflow_tasks_.empty())
+        {
+            task = std::move(overflow_tasks_.front());
+            overflow_tasks_.pop_front();
+            --overflow_count_;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::HasTask(concurrency_t index) const
+{
+    const Worker& self = *workers_[index];
+    if(!self.pinned.Empty() || self.pinned_overflow_count.load(std::memory_order_relaxed) > 0)
+    {
+        return true;
+    }
+    if(overflow_count_.load(std::memory_order_relaxed) > 0)
+    {
+        return true;
+    }
+    for(concurrency_t i{0}; i < thread_count_; ++i)
+    {
+        if(!workers_[i]->queue.Empty())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerThread(concurrency_t index)
+{
+    tls_pool = this;
+    tls_index = index;
+    Worker& self = *workers_[index];
+    Task task;
     while(running_)
     {
-        function<void()> task;
-        unique_lock<mutex> tasks_lock{tasks_mutex_};
-        task_available_cv_.wait(tasks_lock, [&]{
-            return !tasks_.empty() || !running_;
-        });
-        if(running_ && !paused_)
+        if(!paused_ && TakeTask(index, task))
         {
-            task = move(tasks_.front());
-            tasks_.pop();
-            tasks_lock.unlock();
             task();
-            tasks_lock.lock();
+            task.Reset();
             --tasks_total_;
             if(waiting_)
             {
+                scoped_lock tasks_lock{tasks_mutex_};
                 task_done_cv_.notify_one();
             }
+            continue;
+        }
+        // 没有任务了，准备睡眠
+        unique_lock<mutex> sleep_lock{self.sleep_mutex};
+        self.sleeping.store(true, std::memory_order_seq_cst);
+        ++idle_count_;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // 宣布睡眠之后再检查一次，投递者要么看到sleeping，要么这里能看到任务
+        if(running_ && (paused_ || !HasTask(index)))
+        {
+            self.sleep_cv.wait(sleep_lock, [&]{
+                return !self.sleeping.load() || !running_;
+            });
         }
+        self.sleeping = false;
+        --idle_count_;
     }
-}
\ No newline at end of file
+}
@@ -8,6 +8,14 @@ endif
 
 MyFlags = -std=c++17 -lpthread
 
+ifeq ($(MEMORY_STATS), true)
+MyFlags += -DHAO_MEMORY_STATS
+endif
+
+ifneq ($(LOG_MIN_LEVEL),)
+MyFlags += -DHAO_LOG_MIN_LEVEL=$(LOG_MIN_LEVEL)
+endif
+
 # 扫描当前目录下所有.cpp文件
 Sources = $(wildcard *.cpp)
 
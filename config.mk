@@ -15,4 +15,11 @@ Build_Dir = $(Build_Root)/app/log/ \
 
 
 # 调试工具，包括valgrind来使用
-export DEBUG = true
\ No newline at end of file
+export DEBUG = true
+
+# 内存分配统计，打开后会在PrintInfo中输出，改动后要make clean重新编译
+export MEMORY_STATS = false
+
+# 编译期保留的最低日志级别，数值更大的日志语句不会编译进程序，9为全部保留(含TRACE)
+# release时一般设为7(INFO)，热点路径上的TRACE/DEBUG日志就没有任何开销了，改动后要make clean重新编译
+export LOG_MIN_LEVEL = 9
\ No newline at end of file
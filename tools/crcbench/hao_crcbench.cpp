@@ -0,0 +1,126 @@
+// hao_crcbench: 校验GetCRC各个实现的结果完全一致，并比较它们以及其他包头校验算法的速度
+// 用法: hao_crcbench [每种长度的总字节数(MB)，默认256]
+#include "hao_algorithm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using std::vector;
+
+namespace
+{
+    using CRCFunction = uint32_t (*)(const unsigned char *data, size_t len);
+
+    struct Candidate
+    {
+        const char* name;
+        CRCFunction function;
+    };
+
+    // 各种长度和起始对齐下都要和逐字节查表的结果相同
+    bool Verify(const vector<Candidate>& candidates, const vector<unsigned char>& data)
+    {
+        for(size_t offset = 0; offset < 16; ++offset)
+        {
+            for(size_t len = 0; len + offset <= 2048; ++len)
+            {
+                uint32_t expected = GetCRCBytewise(data.data() + offset, len);
+                for(const Candidate& candidate : candidates)
+                {
+                    if(candidate.function(data.data() + offset, len) != expected)
+                    {
+                        std::printf("%s 在 offset=%zu len=%zu 时结果不同\n", candidate.name, offset, len);
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // 其他校验算法和公开的测试向量比较
+    bool VerifyKnownAnswers()
+    {
+        const unsigned char* digits = reinterpret_cast<const unsigned char*>("123456789");
+        const unsigned char* abc = reinterpret_cast<const unsigned char*>("abc");
+        if(GetCRC32C(digits, 9) != 0xE3069283u)
+        {
+            std::printf("crc32c 结果错误\n");
+            return false;
+        }
+        if(GetXXHash64(abc, 0) != 0xEF46DB3751D8E999ull || GetXXHash64(abc, 3) != 0x44BC2CF5AD770999ull)
+        {
+            std::printf("xxhash64 结果错误\n");
+            return false;
+        }
+        return true;
+    }
+
+    double Measure(CRCFunction function, const unsigned char* data, size_t len, size_t total_bytes)
+    {
+        size_t rounds = std::max<size_t>(total_bytes / len, 1);
+        volatile uint32_t sink{0};
+        auto begin = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < rounds; ++i)
+        {
+            sink = sink + function(data, len);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - begin).count();
+        return static_cast<double>(rounds) * len / seconds / (1024.0 * 1024.0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+    vector<unsigned char> data(32 * 1024);
+    std::mt19937 engine(2024);
+    for(auto& byte : data)
+    {
+        byte = static_cast<unsigned char>(engine());
+    }
+
+    vector<Candidate> candidates{
+        {"bytewise", GetCRCBytewise},
+        {"slicing-by-8", GetCRCSlicing8},
+    };
+    if(HasCRCPclmul())
+    {
+        candidates.push_back({"pclmul", GetCRCPclmul});
+    }
+    candidates.push_back({"GetCRC", GetCRC});
+
+    if(!Verify(candidates, data) || !VerifyKnownAnswers())
+    {
+        return 1;
+    }
+    std::printf("结果校验通过，GetCRC使用的实现: %s\n", GetCRCName());
+    // 监听端口可以配置的其他算法也放在一起比较
+    for(const char* name : {"crc32c", "xxhash64"})
+    {
+        candidates.push_back({name, FindChecksum(name)->compute});
+    }
+
+    // 最小的包，典型的业务包，以及接近上限的包
+    const size_t lengths[]{16, 64, 256, 1024, 4096, 30000};
+    std::printf("%-14s", "长度(字节)");
+    for(size_t len : lengths)
+    {
+        std::printf("%10zu", len);
+    }
+    std::printf("   (MB/s)\n");
+    for(const Candidate& candidate : candidates)
+    {
+        std::printf("%-14s", candidate.name);
+        for(size_t len : lengths)
+        {
+            std::printf("%10.0f", Measure(candidate.function, data.data(), len, total_mb * 1024 * 1024));
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
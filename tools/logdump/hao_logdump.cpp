@@ -0,0 +1,265 @@
+// hao_logdump: 把二进制日志还原成和文本日志相同的格式，输出到标准输出
+// 用法: hao_logdump 日志文件...
+// 多个文件(比如轮转出来的旧文件和当前文件)按给出的顺序输出，调用点定义在所有文件之间共用
+// 轮转后新文件开头的一些记录，定义可能只写在了上一个文件中，解码一个文件时最好把上一个文件也带上
+#include "hao_log_format.h"
+
+#include <time.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace hao_log;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+namespace
+{
+    struct Site
+    {
+        string      file;
+        uint32_t    line;
+    };
+
+    bool LoadFile(const char* path, string& data)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if(!in)
+        {
+            std::fprintf(stderr, "打开%s失败\n", path);
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if(data.size() < sizeof(binary::kMagic) || std::memcmp(data.data(), binary::kMagic, sizeof(binary::kMagic)) != 0)
+        {
+            std::fprintf(stderr, "%s不是二进制日志\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    // 依次处理文件中的每条记录，记录不完整时停止
+    template<typename F>
+    void ForEachRecord(const char* path, const string& data, F&& handle)
+    {
+        size_t pos = sizeof(binary::kMagic);
+        while(pos + sizeof(binary::RecordHeader) <= data.size())
+        {
+            binary::RecordHeader header;
+            std::memcpy(&header, data.data() + pos, sizeof(header));
+            if(header.length < sizeof(header) || pos + header.length > data.size())
+            {
+                std::fprintf(stderr, "%s在偏移%zu处的记录不完整\n", path, pos);
+                return;
+            }
+            handle(header.kind, data.data() + pos + sizeof(header), header.length - sizeof(header));
+            pos += header.length;
+        }
+    }
+
+    void AddSite(unordered_map<uint32_t, Site>& sites, const char* body, size_t len)
+    {
+        binary::SiteRecord record;
+        if(len < sizeof(record))
+        {
+            return;
+        }
+        std::memcpy(&record, body, sizeof(record));
+        if(sizeof(record) + record.file_len > len)
+        {
+            return;
+        }
+        sites[record.site_id] = Site{string(body + sizeof(record), record.file_len), record.line};
+    }
+
+    template<typename T>
+    bool ReadValue(const char*& cur, const char* end, T& value)
+    {
+        if(static_cast<size_t>(end - cur) < sizeof(T))
+        {
+            return false;
+        }
+        std::memcpy(&value, cur, sizeof(T));
+        cur += sizeof(T);
+        return true;
+    }
+
+    // 参数按Log::operator<<的文本格式输出
+    void RenderArgs(string& out, const char* cur, const char* end)
+    {
+        char buffer[64];
+        while(cur < end)
+        {
+            uint8_t tag = static_cast<uint8_t>(*cur++);
+            int n{0};
+            switch(tag)
+            {
+            case binary::kBool:
+            {
+                uint8_t value;
+                if(!ReadValue(cur, end, value)) return;
+                out += value ? '1' : '0';
+                break;
+            }
+            case binary::kChar:
+            {
+                char value;
+                if(!ReadValue(cur, end, value)) return;
+                out += value;
+                break;
+            }
+            case binary::kInt32:
+            {
+                int32_t value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "%" PRId32, value);
+                break;
+            }
+            case binary::kUint32:
+            {
+                uint32_t value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "%" PRIu32, value);
+                break;
+            }
+            case binary::kInt64:
+            {
+                int64_t value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "%" PRId64, value);
+                break;
+            }
+            case binary::kUint64:
+            {
+                uint64_t value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "%" PRIu64, value);
+                break;
+            }
+            case binary::kDouble:
+            {
+                double value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "%.12g", value);
+                break;
+            }
+            case binary::kPointer:
+            {
+                uint64_t value;
+                if(!ReadValue(cur, end, value)) return;
+                n = std::snprintf(buffer, sizeof(buffer), "0x%" PRIX64, value);
+                break;
+            }
+            case binary::kString:
+            {
+                uint16_t len;
+                if(!ReadValue(cur, end, len) || end - cur < len) return;
+                out.append(cur, len);
+                cur += len;
+                break;
+            }
+            default:
+                // 不认识的类型，后面的参数没法解析了
+                out += "<?>";
+                return;
+            }
+            out.append(buffer, n);
+        }
+    }
+
+    // 输出格式和Log::Log中的文本格式一致
+    void RenderRecord(string& out, const unordered_map<uint32_t, Site>& sites, const char* body, size_t len)
+    {
+        binary::LogRecord record;
+        if(len < sizeof(record))
+        {
+            return;
+        }
+        std::memcpy(&record, body, sizeof(record));
+
+        char buffer[128];
+        time_t seconds = static_cast<time_t>(record.time_us / 1000000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        size_t n = strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &local);
+        std::snprintf(buffer + n, sizeof(buffer) - n, ".%06d %d ",
+                        static_cast<int>(record.time_us % 1000000), static_cast<int>(record.pid));
+        out += buffer;
+        out.append(h_level_string(record.level <= 9 ? record.level : 0), 8);
+
+        auto it = sites.find(record.site_id);
+        if(it != sites.end())
+        {
+            out += '[';
+            out += it->second.file;
+            out += ' ';
+            out += std::to_string(it->second.line);
+            out += ']';
+        }
+        else
+        {
+            // 定义在没有给出的文件中，一般是上一个轮转出去的文件
+            std::snprintf(buffer, sizeof(buffer), "[site %08" PRIx32 "]", record.site_id);
+            out += buffer;
+        }
+        if(record.err)
+        {
+            out += "err:";
+            out += std::to_string(record.err);
+            out += ' ';
+            out += std::strerror(record.err);
+            out += ' ';
+        }
+        RenderArgs(out, body + sizeof(record), body + len);
+        out += '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::fprintf(stderr, "用法: %s 日志文件...\n", argv[0]);
+        return 1;
+    }
+    vector<string> contents(argc - 1);
+    unordered_map<uint32_t, Site> sites;
+    // 第一遍只收集调用点定义，异步模式下定义可能比用到它的记录更晚写入文件
+    for(int i{1}; i < argc; ++i)
+    {
+        if(!LoadFile(argv[i], contents[i - 1]))
+        {
+            return 1;
+        }
+        ForEachRecord(argv[i], contents[i - 1], [&sites](uint8_t kind, const char* body, size_t len){
+            if(kind == binary::kSiteRecord)
+            {
+                AddSite(sites, body, len);
+            }
+        });
+    }
+    string out;
+    for(int i{1}; i < argc; ++i)
+    {
+        ForEachRecord(argv[i], contents[i - 1], [&](uint8_t kind, const char* body, size_t len){
+            if(kind == binary::kLogRecord)
+            {
+                RenderRecord(out, sites, body, len);
+                if(out.size() >= 64 * 1024)
+                {
+                    std::fwrite(out.data(), 1, out.size(), stdout);
+                    out.clear();
+                }
+            }
+        });
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}